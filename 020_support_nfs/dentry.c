@@ -3,8 +3,11 @@
 #include <linux/mount.h>
 #include <linux/fs_stack.h>
 
+#define	LOOPFS_DBG_CLASS	LOOPFS_DBG_DENTRY
+
 #include "loopfs.h"
 #include "loopfs_util.h"
+#include "loopfs_trace.h"
 
 
 
@@ -23,6 +26,8 @@ int loopfs_init_dentry_cache(void)
 
 void loopfs_destroy_dentry_cache(void)
 {
+	/* wait for the frees queued by free_dentry_private_data */
+	rcu_barrier();
 	if (loopfs_dentry_cachep) {
 		kmem_cache_destroy(loopfs_dentry_cachep);
 	}
@@ -35,28 +40,39 @@ int new_dentry_private_data(struct dentry *dentry)
 
 	LDBG("new_dentry_private_data!\n");
 
-	/* use zalloc to init dentry_info.lower_path */
+	/* use zalloc to init dentry_info.lower_dentry */
 	info = kmem_cache_zalloc(loopfs_dentry_cachep, GFP_ATOMIC);
 	if (!info) {
 		return -ENOMEM;
 	}
 
-	spin_lock_init(&info->lock);
 	dentry->d_fsdata = info;
 
 	return 0;
 }
 
+static void loopfs_dentry_info_free_rcu(struct rcu_head *head)
+{
+	struct loopfs_dentry_info *info = container_of(head,
+					struct loopfs_dentry_info, rcu);
+
+	kmem_cache_free(loopfs_dentry_cachep, info);
+}
+
 void free_dentry_private_data(struct dentry *dentry)
 {
-	LDBG("__loopfs_interpose!\n");
+	struct loopfs_dentry_info *info;
+
+	LDBG("free_dentry_private_data!\n");
 
 	if (!dentry || !dentry->d_fsdata) {
 		return;
 	}
 
-	kmem_cache_free(loopfs_dentry_cachep, dentry->d_fsdata);
-	dentry->d_fsdata = NULL;
+	/* RCU-walk may still be looking at it, see loopfs_d_revalidate_rcu */
+	info = dentry->d_fsdata;
+	WRITE_ONCE(dentry->d_fsdata, NULL);
+	call_rcu(&info->rcu, loopfs_dentry_info_free_rcu);
 }
 
 
@@ -162,12 +178,23 @@ static struct dentry *__loopfs_lookup(struct dentry *dentry,
 
 	/* no error: handle positive dentries */
 	if (!err) {
-		loopfs_set_lower_path(dentry, &lower_path);
+		/*
+		 * Only the lower dentry is kept per dentry; the mount is the
+		 * one pinned by the superblock, so don't follow the lookup
+		 * onto another mount.
+		 */
+		if (lower_path.mnt != lower_dir_mnt) {
+			path_put(&lower_path);
+			err = -EXDEV;
+			goto out;
+		}
+		mntput(lower_path.mnt);
+		loopfs_set_lower_dentry(dentry, lower_path.dentry);
 		ret_dentry = __loopfs_interpose(dentry, dentry->d_sb, &lower_path);
 		if (IS_ERR(ret_dentry)) {
 			err = PTR_ERR(ret_dentry);
-			 /* path_put underlying path on error */
-			loopfs_put_reset_lower_path(dentry);
+			 /* dput underlying dentry on error */
+			loopfs_put_reset_lower_dentry(dentry);
 		}
 		goto out;
 	}
@@ -197,9 +224,7 @@ static struct dentry *__loopfs_lookup(struct dentry *dentry,
 	d_add(lower_dentry, NULL); /* instantiate and hash */
 
 setup_lower:
-	lower_path.dentry = lower_dentry;
-	lower_path.mnt = mntget(lower_dir_mnt);
-	loopfs_set_lower_path(dentry, &lower_path);
+	loopfs_set_lower_dentry(dentry, lower_dentry);
 
 	/*
 	 * If the intent is to create a file, then don't return an error, so
@@ -224,8 +249,10 @@ struct dentry *loopfs_lookup(struct inode *dir, struct dentry *dentry,
 	int err;
 	struct dentry *ret, *parent;
 	struct path lower_parent_path;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_lookup!\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_LOOKUP, dir->i_sb, dir->i_ino, 0, dentry->d_name.len);
 	
 	parent = dget_parent(dentry);
 
@@ -253,10 +280,38 @@ struct dentry *loopfs_lookup(struct inode *dir, struct dentry *dentry,
 out:
 	loopfs_put_lower_path(parent, &lower_parent_path);
 	dput(parent);
+	loopfs_trace_exit(&tr, PTR_ERR_OR_ZERO(ret));
 	return ret;
 }
 
 
+static int loopfs_d_revalidate_rcu(struct dentry *dentry, unsigned int flags)
+{
+	struct loopfs_dentry_info *info;
+	struct dentry *lower_dentry;
+
+	/*
+	 * RCU-walk: no lock and no references.  d_fsdata and the lower dentry
+	 * are both freed after an RCU grace period, so they stay readable
+	 * here even if the dentry is being killed; the walk rechecks d_seq
+	 * afterwards.  The lower ->d_revalidate sees LOOKUP_RCU as well and
+	 * returns -ECHILD if it cannot decide without blocking.
+	 */
+	info = READ_ONCE(dentry->d_fsdata);
+	if (!info) {
+		return -ECHILD;
+	}
+	lower_dentry = rcu_dereference(info->lower_dentry);
+	if (!lower_dentry) {
+		return -ECHILD;
+	}
+
+	if (!(READ_ONCE(lower_dentry->d_flags) & DCACHE_OP_REVALIDATE)) {
+		return 1;
+	}
+	return lower_dentry->d_op->d_revalidate(lower_dentry, flags);
+}
+
 /*
  * returns: -ERRNO if error (returned to user)
  *          0: tell VFS to invalidate dentry
@@ -271,7 +326,7 @@ static int loopfs_d_revalidate(struct dentry *dentry, unsigned int flags)
 	LDBG("loopfs_d_revalidate\n");
 
 	if (flags & LOOKUP_RCU) {
-		return -ECHILD;
+		return loopfs_d_revalidate_rcu(dentry, flags);
 	}
 
 	loopfs_get_lower_path(dentry, &lower_path);
@@ -290,7 +345,7 @@ static void loopfs_d_release(struct dentry *dentry)
 	LDBG("loopfs_d_release\n");
 
 	// /* release and reset the lower paths */
-	loopfs_put_reset_lower_path(dentry);
+	loopfs_put_reset_lower_dentry(dentry);
 	free_dentry_private_data(dentry);
 
 	return;
@@ -1,49 +1,33 @@
 #include <linux/fs_stack.h>
 #include <linux/slab.h>
 #include <linux/file.h>
+#include <linux/mman.h>
+
+#define	LOOPFS_DBG_CLASS	LOOPFS_DBG_FILE
 
 #include "loopfs.h"
 #include "loopfs_util.h"
+#include "loopfs_trace.h"
 
 
-static ssize_t loopfs_read(struct file *file, char __user *buf,
-				size_t count, loff_t *ppos)
+/*
+ * fcntl(F_SETFL) only changes the flags of the upper file; carry O_DIRECT
+ * over to the lower file before doing I/O on it.
+ */
+static int loopfs_sync_direct_flag(struct file *file, struct file *lower_file)
 {
-	int err;
-	struct file *lower_file;
-	struct dentry *dentry = file->f_path.dentry;
-	
-	LDBG("loopfs_read\n");
-
-	lower_file = loopfs_lower_file(file);
-	err = vfs_read(lower_file, buf, count, ppos);
-	/* update our inode atime upon a successful lower read */
-	if (err >= 0) {
-		fsstack_copy_attr_atime(d_inode(dentry), file_inode(lower_file));
+	if (!((file->f_flags ^ lower_file->f_flags) & O_DIRECT)) {
+		return 0;
 	}
 
-	return err;
-}
-
-static ssize_t loopfs_write(struct file *file, const char __user *buf,
-				size_t count, loff_t *ppos)
-{
-	int err;
-
-	struct file *lower_file;
-	struct dentry *dentry = file->f_path.dentry;
-	
-	LDBG("loopfs_write\n");
-
-	lower_file = loopfs_lower_file(file);
-	err = vfs_write(lower_file, buf, count, ppos);
-	/* update our inode times+sizes upon a successful lower write */
-	if (err >= 0) {
-		fsstack_copy_inode_size(d_inode(dentry), file_inode(lower_file));
-		fsstack_copy_attr_times(d_inode(dentry), file_inode(lower_file));
+	if ((file->f_flags & O_DIRECT) && !lower_file->f_mapping->a_ops->direct_IO) {
+		return -EINVAL;
 	}
 
-	return err;
+	spin_lock(&lower_file->f_lock);
+	lower_file->f_flags = (lower_file->f_flags & ~O_DIRECT) | (file->f_flags & O_DIRECT);
+	spin_unlock(&lower_file->f_lock);
+	return 0;
 }
 
 static int loopfs_readdir(struct file *file, struct dir_context *ctx)
@@ -51,8 +35,10 @@ static int loopfs_readdir(struct file *file, struct dir_context *ctx)
 	int err;
 	struct file *lower_file = NULL;
 	struct dentry *dentry = file->f_path.dentry;
+	struct loopfs_op_trace tr;
 	
 	LDBG("loopfs_readdir\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_READDIR, file_inode(file)->i_sb, file_inode(file)->i_ino, ctx->pos, 0);
 
 	lower_file = loopfs_lower_file(file);
 	err = iterate_dir(lower_file, ctx);
@@ -61,6 +47,7 @@ static int loopfs_readdir(struct file *file, struct dir_context *ctx)
 		/* copy the atime */
 		fsstack_copy_attr_atime(d_inode(dentry), file_inode(lower_file));
 	}
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -69,8 +56,10 @@ static long loopfs_unlocked_ioctl(struct file *file, unsigned int cmd,
 {
 	long err = -ENOTTY;
 	struct file *lower_file;
+	struct loopfs_op_trace tr;
 	
 	LDBG("loopfs_unlocked_ioctl\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_IOCTL, file_inode(file)->i_sb, file_inode(file)->i_ino, 0, 0);
 
 	lower_file = loopfs_lower_file(file);
 
@@ -87,6 +76,7 @@ static long loopfs_unlocked_ioctl(struct file *file, unsigned int cmd,
 		fsstack_copy_attr_all(file_inode(file), file_inode(lower_file));
 	}
 out:
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -96,8 +86,10 @@ static long loopfs_compat_ioctl(struct file *file, unsigned int cmd,
 {
 	long err = -ENOTTY;
 	struct file *lower_file;
+	struct loopfs_op_trace tr;
 	
 	LDBG("loopfs_compat_ioctl\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_COMPAT_IOCTL, file_inode(file)->i_sb, file_inode(file)->i_ino, 0, 0);
 
 	lower_file = loopfs_lower_file(file);
 
@@ -110,78 +102,148 @@ static long loopfs_compat_ioctl(struct file *file, unsigned int cmd,
 	}
 
 out:
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 #endif
 
+/*
+ * backing_mmap mount option: map the lower file itself and keep the lower
+ * vm_ops, so page faults go straight to the lower file system without the
+ * vma copy in loopfs_fault.  Like overlayfs does for its real files, the
+ * lower file is reopened with the loopfs path as f_path, so that
+ * /proc/pid/maps still shows the loopfs path.
+ */
+static int loopfs_backing_mmap(struct file *file, struct file *lower_file,
+				struct vm_area_struct *vma)
+{
+	int err;
+	struct file *map_file;
+
+	if (!lower_file->f_op->mmap) {
+		return -ENODEV;
+	}
+
+	map_file = open_with_fake_path(&file->f_path, lower_file->f_flags,
+				file_inode(lower_file), file->f_cred);
+	if (IS_ERR(map_file)) {
+		return PTR_ERR(map_file);
+	}
+
+	/* the vma takes its own reference to map_file */
+	vma_set_file(vma, map_file);
+	err = call_mmap(map_file, vma);
+	if (err) {
+		vma_set_file(vma, file);
+	} else {
+		file_accessed(file);
+	}
+	fput(map_file);
+
+	return err;
+}
+
 static int loopfs_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	int err = 0;
-	bool willwrite;
 	struct file *lower_file;
-	const struct vm_operations_struct *saved_vm_ops = NULL;
+	struct loopfs_op_trace tr;
 	
 	LDBG("loopfs_mmap\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_MMAP, file_inode(file)->i_sb, file_inode(file)->i_ino,
+			(loff_t)vma->vm_pgoff << PAGE_SHIFT, vma->vm_end - vma->vm_start);
 
-	/* this might be deferred to mmap's writepage */
-	willwrite = ((vma->vm_flags | VM_SHARED | VM_WRITE) == vma->vm_flags);
+	lower_file = loopfs_lower_file(file);
 
 	/*
-	 * File systems which do not implement ->writepage may use
-	 * generic_file_readonly_mmap as their ->mmap op.  If you call
-	 * generic_file_readonly_mmap with VM_WRITE, you'd get an -EINVAL.
-	 * But we cannot call the lower ->mmap op, so we can't tell that
-	 * writeable mappings won't work.  Therefore, our only choice is to
-	 * check if the lower file system supports the ->writepage, and if
-	 * not, return EINVAL (the same error that
-	 * generic_file_readonly_mmap returns in that case).
+	 * We accept MAP_SYNC on behalf of the lower, see loopfs_main_fops.
+	 * Checked for both paths: a lower ->mmap that does not support it
+	 * will not reject VM_SYNC by itself.
 	 */
-	lower_file = loopfs_lower_file(file);
-	if (willwrite && !lower_file->f_mapping->a_ops->writepage) {
-		err = -EINVAL;
-		printk(KERN_ERR "loopfs: lower file system does not "
-				"support writeable mmap\n");
+	if ((vma->vm_flags & VM_SYNC) &&
+			!(lower_file->f_op->mmap_supported_flags & MAP_SYNC)) {
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+
+	if (loopfs_test_opt(file_inode(file)->i_sb, BACKING_MMAP)) {
+		err = loopfs_backing_mmap(file, lower_file, vma);
+		goto out;
+	}
+
+	if (!lower_file->f_op->mmap) {
+		err = -ENODEV;
 		goto out;
 	}
 
 	/*
-	 * find and save lower vm_ops.
+	 * Call the lower ->mmap on every mapping, not only to find the lower
+	 * vm_ops: it rejects mappings it cannot serve (writeable mappings of
+	 * generic_file_readonly_mmap, MAP_SYNC without DAX) and sets up the
+	 * vma flags its faults rely on, such as VM_HUGEPAGE for DAX.
 	 *
 	 * XXX: the VFS should have a cleaner way of finding the lower vm_ops
 	 */
+	err = lower_file->f_op->mmap(lower_file, vma);
+	if (err) {
+		printk(KERN_ERR "loopfs: lower mmap failed %d\n", err);
+		goto out;
+	}
+
 	if (!LOOPFS_F(file)->lower_vm_ops) {
-		err = lower_file->f_op->mmap(lower_file, vma);
-		if (err) {
-			printk(KERN_ERR "loopfs: lower mmap failed %d\n", err);
-			goto out;
-		}
-		saved_vm_ops = vma->vm_ops; /* save: came from lower ->mmap */
+		/* save for our ->fault */
+		LOOPFS_F(file)->lower_vm_ops = vma->vm_ops;
 	}
 
 	/*
-	 * Next 3 lines are all I need from generic_file_mmap.  I definitely
+	 * Next 2 lines are all I need from generic_file_mmap.  I definitely
 	 * don't want its test for ->readpage which returns -ENOEXEC.
 	 */
 	file_accessed(file);
 	vma->vm_ops = &loopfs_vm_ops;
 
-	file->f_mapping->a_ops = &loopfs_aops; /* set our aops */
-	if (!LOOPFS_F(file)->lower_vm_ops) {
-		/* save for our ->fault */
-		LOOPFS_F(file)->lower_vm_ops = saved_vm_ops;
-	}
-
 out:
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
+/*
+ * Let the lower file pick the address, so that a file on a lower which
+ * can map it with PMD-sized pages (tmpfs huge=, DAX) gets a suitably
+ * aligned mapping.
+ */
+static unsigned long loopfs_get_unmapped_area(struct file *file,
+				unsigned long addr, unsigned long len, unsigned long pgoff,
+				unsigned long flags)
+{
+	unsigned long ret;
+	struct file *lower_file;
+	struct loopfs_op_trace tr;
+
+	LDBG("loopfs_get_unmapped_area\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_GET_UNMAPPED_AREA, file_inode(file)->i_sb, file_inode(file)->i_ino,
+			(loff_t)pgoff << PAGE_SHIFT, len);
+
+	lower_file = loopfs_lower_file(file);
+	if (lower_file->f_op->get_unmapped_area) {
+		ret = lower_file->f_op->get_unmapped_area(lower_file, addr, len, pgoff, flags);
+	} else {
+		ret = current->mm->get_unmapped_area(file, addr, len, pgoff, flags);
+	}
+
+	loopfs_trace_exit(&tr, IS_ERR_VALUE(ret) ? (long)ret : 0);
+	return ret;
+}
+
 static int loopfs_open(struct inode *inode, struct file *file)
 {
 	int err = 0;
 	struct file *lower_file = NULL;
 	struct path lower_path;
+	struct loopfs_op_trace tr;
 	
 	LDBG("loopfs_open\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_OPEN, inode->i_sb, inode->i_ino, 0, 0);
 
 	/* don't open unhashed/deleted files */
 	if (d_unhashed(file->f_path.dentry)) {
@@ -198,7 +260,7 @@ static int loopfs_open(struct inode *inode, struct file *file)
 	/* open lower object and link loopfs's file struct to lower's */
 	loopfs_get_lower_path(file->f_path.dentry, &lower_path);
 	lower_file = dentry_open(&lower_path, file->f_flags, current_cred());
-	path_put(&lower_path);
+	loopfs_put_lower_path(file->f_path.dentry, &lower_path);
 	if (IS_ERR(lower_file)) {
 		err = PTR_ERR(lower_file);
 		lower_file = loopfs_lower_file(file);
@@ -208,15 +270,32 @@ static int loopfs_open(struct inode *inode, struct file *file)
 		}
 	} else {
 		loopfs_set_lower_file(file, lower_file);
+		/* let io_uring issue IOCB_NOWAIT I/O inline if the lower can */
+		file->f_mode |= lower_file->f_mode & (FMODE_NOWAIT | FMODE_BUF_RASYNC);
+		/*
+		 * Our own mapping never holds pages.  Point f_mapping at the
+		 * lower one, so that sync_file_range, fdatawait and the other
+		 * helpers working on file->f_mapping reach the lower pages, and
+		 * so that our vmas go on the lower i_mmap where rmap finds them.
+		 * It is also why we need no ->direct_IO of our own: the O_DIRECT
+		 * checks in do_dentry_open() (made after ->open) and in setfl()
+		 * look at f_mapping->a_ops, so they ask the lower file system.
+		 */
+		if (S_ISREG(inode->i_mode)) {
+			file->f_mapping = lower_file->f_mapping;
+			file->f_wb_err = filemap_sample_wb_err(file->f_mapping);
+		}
 	}
 
 	if (err) {
 		kfree(LOOPFS_F(file));
 	} else {
+		loopfs_refresh_attr(inode);
 		fsstack_copy_attr_all(inode, loopfs_lower_inode(inode));
 	}
 
 out_err:
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -224,15 +303,18 @@ static int loopfs_flush(struct file *file, fl_owner_t id)
 {
 	int err = 0;
 	struct file *lower_file = NULL;
+	struct loopfs_op_trace tr;
 	
 	LDBG("loopfs_flush\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_FLUSH, file_inode(file)->i_sb, file_inode(file)->i_ino, 0, 0);
 
 	lower_file = loopfs_lower_file(file);
 	if (lower_file && lower_file->f_op && lower_file->f_op->flush) {
-		filemap_write_and_wait(file->f_mapping);
+		filemap_write_and_wait(file_inode(file)->i_mapping);
 		err = lower_file->f_op->flush(lower_file, id);
 	}
 
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -240,8 +322,13 @@ static int loopfs_flush(struct file *file, fl_owner_t id)
 static int loopfs_file_release(struct inode *inode, struct file *file)
 {
 	struct file *lower_file;
+	struct loopfs_op_trace tr;
 	
 	LDBG("loopfs_file_release\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_RELEASE, inode->i_sb, inode->i_ino, 0, 0);
+
+	/* lazyattr: last chance to copy up what this file did */
+	loopfs_refresh_attr(inode);
 
 	lower_file = loopfs_lower_file(file);
 	if (lower_file) {
@@ -250,28 +337,39 @@ static int loopfs_file_release(struct inode *inode, struct file *file)
 	}
 
 	kfree(LOOPFS_F(file));
+	loopfs_trace_exit(&tr, 0);
 	return 0;
 }
 
 static int loopfs_fsync(struct file *file, loff_t start, loff_t end,
 				int datasync)
 {
-	int err;
+	int err, err2;
 	struct file *lower_file;
 	struct path lower_path;
 	struct dentry *dentry = file->f_path.dentry;
+	struct loopfs_op_trace tr;
 	
 	LDBG("loopfs_fsync\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_FSYNC, file_inode(file)->i_sb, file_inode(file)->i_ino, start, end - start);
 
-	err = __generic_file_fsync(file, start, end, datasync);
-	if (err) {
-		goto out;
-	}
 	lower_file = loopfs_lower_file(file);
 	loopfs_get_lower_path(dentry, &lower_path);
 	err = vfs_fsync_range(lower_file, start, end, datasync);
 	loopfs_put_lower_path(dentry, &lower_path);
-out:
+	loopfs_refresh_attr(file_inode(file));
+
+	/*
+	 * A regular file shares the lower mapping (see loopfs_open), so the
+	 * lower fsync wrote our data.  Report its writeback errors once on
+	 * this file too.
+	 */
+	err2 = file_check_and_advance_wb_err(file);
+	if (!err) {
+		err = err2;
+	}
+
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -279,14 +377,17 @@ static int loopfs_fasync(int fd, struct file *file, int flag)
 {
 	int err = 0;
 	struct file *lower_file = NULL;
+	struct loopfs_op_trace tr;
 	
 	LDBG("loopfs_fasync\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_FASYNC, file_inode(file)->i_sb, file_inode(file)->i_ino, 0, 0);
 
 	lower_file = loopfs_lower_file(file);
 	if (lower_file->f_op && lower_file->f_op->fasync) {
 		err = lower_file->f_op->fasync(fd, lower_file, flag);
 	}
 
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -298,32 +399,184 @@ static int loopfs_fasync(int fd, struct file *file, int flag)
  */
 static loff_t loopfs_file_llseek(struct file *file, loff_t offset, int whence)
 {
-	int err;
+	loff_t err;
 	struct file *lower_file;
+	struct loopfs_op_trace tr;
 	
 	LDBG("loopfs_file_llseek\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_LLSEEK, file_inode(file)->i_sb, file_inode(file)->i_ino, offset, whence);
 
-	err = generic_file_llseek(file, offset, whence);
-	if (err < 0) {
-		goto out;
+	/*
+	 * Seek the lower file, which knows its size and, for SEEK_DATA and
+	 * SEEK_HOLE, where its holes are.  Our I/O passes our own position
+	 * down, so start the lower file from it and take the result back.
+	 * Concurrent seeks on a shared file are serialized by f_pos_lock.
+	 */
+	lower_file = loopfs_lower_file(file);
+	lower_file->f_pos = file->f_pos;
+	err = vfs_llseek(lower_file, offset, whence);
+	if (err >= 0 && file->f_pos != lower_file->f_pos) {
+		file->f_pos = lower_file->f_pos;
+		file->f_version = 0;
 	}
 
-	lower_file = loopfs_lower_file(file);
-	err = generic_file_llseek(lower_file, offset, whence);
+	loopfs_trace_exit(&tr, err);
+	return err;
+}
 
-out:
+/*
+ * Asynchronous lower I/O.  The caller's kiocb may complete long after
+ * ->read_iter/->write_iter returned -EIOCBQUEUED, so the lower file gets
+ * its own cloned kiocb, and the attributes are copied up and the lower
+ * file is released from the clone's completion.  One reference is held
+ * by the submitter and one by the completion.
+ *
+ * Only direct I/O completes this way.  Buffered I/O always finishes
+ * inline; an -EIOCBQUEUED from a buffered IOCB_WAITQ read means that
+ * io_uring will call ->read_iter again once the page is unlocked, and
+ * ki_complete is never called for it.
+ */
+static struct kmem_cache *loopfs_aio_req_cachep;
+
+int loopfs_init_aio_cache(void)
+{
+	loopfs_aio_req_cachep =
+		kmem_cache_create("loopfs_aio_req",
+				  sizeof(struct loopfs_aio_req),
+				  0, SLAB_HWCACHE_ALIGN, NULL);
+
+	return loopfs_aio_req_cachep ? 0 : -ENOMEM;
+}
+
+void loopfs_destroy_aio_cache(void)
+{
+	if (loopfs_aio_req_cachep) {
+		kmem_cache_destroy(loopfs_aio_req_cachep);
+	}
+}
+
+static void loopfs_aio_put(struct loopfs_aio_req *aio_req)
+{
+	if (refcount_dec_and_test(&aio_req->ref)) {
+		fput(aio_req->lower_file);
+		kmem_cache_free(loopfs_aio_req_cachep, aio_req);
+	}
+}
+
+static void loopfs_aio_cleanup(struct loopfs_aio_req *aio_req)
+{
+	struct kiocb *iocb = &aio_req->iocb;
+	struct kiocb *orig_iocb = aio_req->orig_iocb;
+	struct inode *inode = file_inode(orig_iocb->ki_filp);
+	struct inode *lower_inode = file_inode(aio_req->lower_file);
+
+	/* update upper inode attributes now that the I/O is really done */
+	if (iocb->ki_flags & IOCB_WRITE) {
+		/* take over the freeze protection from loopfs_aio_submit */
+		if (S_ISREG(lower_inode->i_mode)) {
+			__sb_writers_acquired(lower_inode->i_sb, SB_FREEZE_WRITE);
+		}
+		file_end_write(aio_req->lower_file);
+		loopfs_copy_attr_write(inode, lower_inode);
+	} else {
+		loopfs_copy_attr_read(inode, lower_inode);
+	}
+
+	orig_iocb->ki_pos = iocb->ki_pos;
+	loopfs_aio_put(aio_req);
+}
+
+static void loopfs_aio_complete(struct kiocb *iocb, long res, long res2)
+{
+	struct loopfs_aio_req *aio_req = container_of(iocb,
+					struct loopfs_aio_req, iocb);
+	struct kiocb *orig_iocb = aio_req->orig_iocb;
+
+	loopfs_aio_cleanup(aio_req);
+	orig_iocb->ki_complete(orig_iocb, res, res2);
+}
+
+static ssize_t loopfs_aio_submit(struct kiocb *iocb, struct iov_iter *iter,
+				struct file *lower_file, bool write)
+{
+	ssize_t err;
+	struct loopfs_aio_req *aio_req;
+
+	/* polled completions only work if the lower file can be polled */
+	if ((iocb->ki_flags & IOCB_HIPRI) && !lower_file->f_op->iopoll) {
+		return -EOPNOTSUPP;
+	}
+
+	aio_req = kmem_cache_zalloc(loopfs_aio_req_cachep,
+				(iocb->ki_flags & IOCB_NOWAIT) ? GFP_NOWAIT : GFP_KERNEL);
+	if (!aio_req) {
+		return (iocb->ki_flags & IOCB_NOWAIT) ? -EAGAIN : -ENOMEM;
+	}
+
+	refcount_set(&aio_req->ref, 2);
+	aio_req->orig_iocb = iocb;
+	aio_req->lower_file = get_file(lower_file);
+	kiocb_clone(&aio_req->iocb, iocb, lower_file);
+	aio_req->iocb.ki_complete = loopfs_aio_complete;
+
+	if (write) {
+		/*
+		 * The lower sb must stay unfrozen until the write completes,
+		 * possibly in another context, so hand the lockdep ownership
+		 * of the freeze protection over to loopfs_aio_cleanup.
+		 */
+		file_start_write(lower_file);
+		if (S_ISREG(file_inode(lower_file)->i_mode)) {
+			__sb_writers_release(file_inode(lower_file)->i_sb, SB_FREEZE_WRITE);
+		}
+		err = lower_file->f_op->write_iter(&aio_req->iocb, iter);
+	} else {
+		err = lower_file->f_op->read_iter(&aio_req->iocb, iter);
+	}
+
+	/* the lower file system completed (or failed) it inline */
+	if (err != -EIOCBQUEUED) {
+		loopfs_aio_cleanup(aio_req);
+	} else if (iocb->ki_flags & IOCB_HIPRI) {
+		/*
+		 * The poller only knows the original kiocb.  Copy the lower
+		 * poll cookie and queue over to it for loopfs_iopoll; io_uring
+		 * cannot reap the request before this submission returns.
+		 */
+		WRITE_ONCE(iocb->ki_cookie, READ_ONCE(aio_req->iocb.ki_cookie));
+		WRITE_ONCE(iocb->private, READ_ONCE(aio_req->iocb.private));
+	}
+	loopfs_aio_put(aio_req);
 	return err;
 }
 
+/* does this kiocb need a clone of its own, see loopfs_aio_submit */
+static inline bool loopfs_is_aio(struct kiocb *iocb)
+{
+	return !is_sync_kiocb(iocb) && (iocb->ki_flags & IOCB_DIRECT);
+}
+
+/*
+ * IOCB_NOWAIT may only reach a lower file that promised not to block;
+ * io_uring sends it to regular files regardless of FMODE_NOWAIT.
+ */
+static inline bool loopfs_nowait_ok(struct kiocb *iocb, struct file *lower_file)
+{
+	return !(iocb->ki_flags & IOCB_NOWAIT) || (lower_file->f_mode & FMODE_NOWAIT);
+}
+
 /*
  * loopfs read_iter, redirect modified iocb to lower read_iter
  */
 ssize_t loopfs_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 {
-	int err;
+	ssize_t err;
 	struct file *file = iocb->ki_filp, *lower_file;
+	struct loopfs_op_trace tr;
 	
 	LDBG("loopfs_read_iter\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_READ_ITER, file_inode(file)->i_sb, file_inode(file)->i_ino,
+			iocb->ki_pos, iov_iter_count(iter));
 
 	lower_file = loopfs_lower_file(file);
 	if (!lower_file->f_op->read_iter) {
@@ -331,16 +584,36 @@ ssize_t loopfs_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 		goto out;
 	}
 
-	get_file(lower_file); /* prevent lower_file from being released */
+	err = loopfs_sync_direct_flag(file, lower_file);
+	if (err) {
+		goto out;
+	}
+
+	if (!loopfs_nowait_ok(iocb, lower_file)) {
+		err = -EAGAIN;
+		goto out;
+	}
+
+	if (loopfs_is_aio(iocb)) {
+		err = loopfs_aio_submit(iocb, iter, lower_file, false);
+		goto out;
+	}
+
+	/*
+	 * No reference of our own on lower_file: the caller pins our file,
+	 * which only drops lower_file in loopfs_file_release.  Taking one
+	 * would bounce the f_count cache line of the lower file between all
+	 * cpus doing I/O on it.
+	 */
 	iocb->ki_filp = lower_file;
 	err = lower_file->f_op->read_iter(iocb, iter);
 	iocb->ki_filp = file;
-	fput(lower_file);
 	/* update upper inode atime as needed */
-	if (err >= 0 || err == -EIOCBQUEUED) {
-		fsstack_copy_attr_atime(d_inode(file->f_path.dentry), file_inode(lower_file));
+	if (err >= 0) {
+		loopfs_copy_attr_read(file_inode(file), file_inode(lower_file));
 	}
 out:
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -349,10 +622,13 @@ out:
  */
 ssize_t loopfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 {
-	int err;
+	ssize_t err;
 	struct file *file = iocb->ki_filp, *lower_file;
+	struct loopfs_op_trace tr;
 	
 	LDBG("loopfs_write_iter\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_WRITE_ITER, file_inode(file)->i_sb, file_inode(file)->i_ino,
+			iocb->ki_pos, iov_iter_count(iter));
 
 	lower_file = loopfs_lower_file(file);
 	if (!lower_file->f_op->write_iter) {
@@ -360,29 +636,246 @@ ssize_t loopfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 		goto out;
 	}
 
-	get_file(lower_file); /* prevent lower_file from being released */
+	err = loopfs_sync_direct_flag(file, lower_file);
+	if (err) {
+		goto out;
+	}
+
+	if (!loopfs_nowait_ok(iocb, lower_file)) {
+		err = -EAGAIN;
+		goto out;
+	}
+
+	if (loopfs_is_aio(iocb)) {
+		err = loopfs_aio_submit(iocb, iter, lower_file, true);
+		goto out;
+	}
+
+	/* no reference of our own on lower_file, see loopfs_read_iter */
 	iocb->ki_filp = lower_file;
+	file_start_write(lower_file);
 	err = lower_file->f_op->write_iter(iocb, iter);
+	file_end_write(lower_file);
 	iocb->ki_filp = file;
-	fput(lower_file);
 	/* update upper inode times/sizes as needed */
-	if (err >= 0 || err == -EIOCBQUEUED) {
-		fsstack_copy_inode_size(d_inode(file->f_path.dentry), file_inode(lower_file));
-		fsstack_copy_attr_times(d_inode(file->f_path.dentry), file_inode(lower_file));
+	if (err >= 0) {
+		loopfs_copy_attr_write(file_inode(file), file_inode(lower_file));
 	}
 out:
+	loopfs_trace_exit(&tr, err);
+	return err;
+}
+
+/*
+ * loopfs iopoll, poll the lower queue for IOCB_HIPRI direct I/O.  The
+ * cookie saved by loopfs_aio_submit lives in the original kiocb, which
+ * is what the lower ->iopoll (iomap_dio_iopoll) reads it from.
+ */
+static int loopfs_iopoll(struct kiocb *iocb, bool spin)
+{
+	struct file *lower_file;
+	int err = 0;
+	struct loopfs_op_trace tr;
+
+	LDBG("loopfs_iopoll\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_IOPOLL, file_inode(iocb->ki_filp)->i_sb,
+			file_inode(iocb->ki_filp)->i_ino, iocb->ki_pos, 0);
+
+	lower_file = loopfs_lower_file(iocb->ki_filp);
+	if (lower_file->f_op->iopoll) {
+		err = lower_file->f_op->iopoll(iocb, spin);
+	}
+
+	loopfs_trace_exit(&tr, err);
+	return err;
+}
+
+/*
+ * loopfs splice_read, hand the lower page-cache pages straight to the pipe
+ */
+static ssize_t loopfs_splice_read(struct file *file, loff_t *ppos,
+				struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_file;
+	struct loopfs_op_trace tr;
+
+	LDBG("loopfs_splice_read\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_SPLICE_READ, file_inode(file)->i_sb, file_inode(file)->i_ino, *ppos, len);
+
+	lower_file = loopfs_lower_file(file);
+	if (!lower_file->f_op->splice_read) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = lower_file->f_op->splice_read(lower_file, ppos, pipe, len, flags);
+	/* update upper inode atime as needed */
+	if (err >= 0) {
+		loopfs_copy_attr_read(file_inode(file), file_inode(lower_file));
+	}
+out:
+	loopfs_trace_exit(&tr, err);
+	return err;
+}
+
+/*
+ * loopfs splice_write, feed the pipe buffers directly to the lower file
+ */
+static ssize_t loopfs_splice_write(struct pipe_inode_info *pipe,
+				struct file *file, loff_t *ppos, size_t len, unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_file;
+	struct loopfs_op_trace tr;
+
+	LDBG("loopfs_splice_write\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_SPLICE_WRITE, file_inode(file)->i_sb, file_inode(file)->i_ino, *ppos, len);
+
+	lower_file = loopfs_lower_file(file);
+	if (!lower_file->f_op->splice_write) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	file_start_write(lower_file);
+	err = lower_file->f_op->splice_write(pipe, lower_file, ppos, len, flags);
+	file_end_write(lower_file);
+	/* update upper inode times/sizes as needed */
+	if (err > 0) {
+		loopfs_copy_attr_write(file_inode(file), file_inode(lower_file));
+	}
+out:
+	loopfs_trace_exit(&tr, err);
+	return err;
+}
+
+/*
+ * loopfs copy_file_range, let the lower file system copy (or clone) the
+ * data itself.  Both files are loopfs files here, but they may live on
+ * different loopfs mounts; vfs_copy_file_range() on the lower files
+ * decides whether the lower superblocks allow a clone.
+ */
+static ssize_t loopfs_copy_file_range(struct file *file_in, loff_t pos_in,
+				struct file *file_out, loff_t pos_out, size_t len, unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_file_in, *lower_file_out;
+	struct loopfs_op_trace tr;
+
+	LDBG("loopfs_copy_file_range\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_COPY_FILE_RANGE, file_inode(file_out)->i_sb,
+			file_inode(file_out)->i_ino, pos_out, len);
+
+	lower_file_in = loopfs_lower_file(file_in);
+	lower_file_out = loopfs_lower_file(file_out);
+
+	err = vfs_copy_file_range(lower_file_in, pos_in, lower_file_out, pos_out,
+				len, flags);
+	/* update upper inode times/sizes as needed */
+	if (err > 0) {
+		loopfs_copy_attr_write(file_inode(file_out), file_inode(lower_file_out));
+		loopfs_copy_attr_read(file_inode(file_in), file_inode(lower_file_in));
+	}
+
+	loopfs_trace_exit(&tr, err);
+	return err;
+}
+
+/*
+ * loopfs remap_file_range, used for FICLONE/FICLONERANGE/FIDEDUPERANGE
+ */
+static loff_t loopfs_remap_file_range(struct file *file_in, loff_t pos_in,
+				struct file *file_out, loff_t pos_out, loff_t len,
+				unsigned int remap_flags)
+{
+	loff_t err;
+	struct file *lower_file_in, *lower_file_out;
+	struct loopfs_op_trace tr;
+
+	LDBG("loopfs_remap_file_range\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_REMAP_FILE_RANGE, file_inode(file_out)->i_sb,
+			file_inode(file_out)->i_ino, pos_out, len);
+
+	if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_ADVISORY)) {
+		loopfs_trace_exit(&tr, -EINVAL);
+		return -EINVAL;
+	}
+
+	lower_file_in = loopfs_lower_file(file_in);
+	lower_file_out = loopfs_lower_file(file_out);
+
+	if (remap_flags & REMAP_FILE_DEDUP) {
+		err = vfs_dedupe_file_range_one(lower_file_in, pos_in,
+					lower_file_out, pos_out, len, remap_flags);
+	} else {
+		err = vfs_clone_file_range(lower_file_in, pos_in,
+					lower_file_out, pos_out, len, remap_flags);
+	}
+	/* update upper inode times/sizes as needed */
+	if (err > 0) {
+		loopfs_copy_attr_write(file_inode(file_out), file_inode(lower_file_out));
+	}
+
+	loopfs_trace_exit(&tr, err);
+	return err;
+}
+
+/*
+ * loopfs fallocate, every mode is interpreted by the lower file system
+ */
+static long loopfs_fallocate(struct file *file, int mode, loff_t offset,
+				loff_t len)
+{
+	long err;
+	struct file *lower_file;
+	struct loopfs_op_trace tr;
+
+	LDBG("loopfs_fallocate\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_FALLOCATE, file_inode(file)->i_sb, file_inode(file)->i_ino, offset, len);
+
+	lower_file = loopfs_lower_file(file);
+	err = vfs_fallocate(lower_file, mode, offset, len);
+	/* size and blocks may change with any mode */
+	if (!err) {
+		loopfs_copy_attr_write(file_inode(file), file_inode(lower_file));
+	}
+
+	loopfs_trace_exit(&tr, err);
+	return err;
+}
+
+/*
+ * loopfs fadvise, the lower file holds the page cache and the readahead
+ * state, so all hints go there.  readahead(2) and madvise(MADV_WILLNEED)
+ * end up here as well.
+ */
+static int loopfs_fadvise(struct file *file, loff_t offset, loff_t len,
+				int advice)
+{
+	int err;
+	struct file *lower_file;
+	struct loopfs_op_trace tr;
+
+	LDBG("loopfs_fadvise\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_FADVISE, file_inode(file)->i_sb, file_inode(file)->i_ino, offset, len);
+
+	lower_file = loopfs_lower_file(file);
+	err = vfs_fadvise(lower_file, offset, len, advice);
+
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
 const struct file_operations loopfs_main_fops = {
-	.llseek		= generic_file_llseek,
-	.read		= loopfs_read,
-	.write		= loopfs_write,
+	.llseek		= loopfs_file_llseek,
 	.unlocked_ioctl	= loopfs_unlocked_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= loopfs_compat_ioctl,
 #endif
 	.mmap		= loopfs_mmap,
+	.get_unmapped_area	= loopfs_get_unmapped_area,
+	.mmap_supported_flags	= MAP_SYNC,
 	.open		= loopfs_open,
 	.flush		= loopfs_flush,
 	.release	= loopfs_file_release,
@@ -390,6 +883,13 @@ const struct file_operations loopfs_main_fops = {
 	.fasync		= loopfs_fasync,
 	.read_iter	= loopfs_read_iter,
 	.write_iter	= loopfs_write_iter,
+	.iopoll		= loopfs_iopoll,
+	.splice_read	= loopfs_splice_read,
+	.splice_write	= loopfs_splice_write,
+	.copy_file_range	= loopfs_copy_file_range,
+	.remap_file_range	= loopfs_remap_file_range,
+	.fallocate	= loopfs_fallocate,
+	.fadvise	= loopfs_fadvise,
 };
 
 /* trimmed directory options */
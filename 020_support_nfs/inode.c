@@ -1,9 +1,13 @@
 #include <linux/fs_stack.h>
 #include <linux/namei.h>
 #include <linux/xattr.h>
+#include <linux/iversion.h>
+
+#define	LOOPFS_DBG_CLASS	LOOPFS_DBG_INODE
 
 #include "loopfs.h"
 #include "loopfs_util.h"
+#include "loopfs_trace.h"
 
 
 static int loopfs_create(struct inode *dir, struct dentry *dentry,
@@ -13,8 +17,10 @@ static int loopfs_create(struct inode *dir, struct dentry *dentry,
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_create\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_CREATE, dir->i_sb, dir->i_ino, 0, 0);
 
 	loopfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -34,6 +40,7 @@ static int loopfs_create(struct inode *dir, struct dentry *dentry,
 out:
 	unlock_dir(lower_parent_dentry);
 	loopfs_put_lower_path(dentry, &lower_path);
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -46,8 +53,10 @@ static int loopfs_link(struct dentry *old_dentry, struct inode *dir,
 	u64 file_size_save;
 	int err;
 	struct path lower_old_path, lower_new_path;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_link\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_LINK, dir->i_sb, dir->i_ino, 0, 0);
 
 	file_size_save = i_size_read(d_inode(old_dentry));
 	loopfs_get_lower_path(old_dentry, &lower_old_path);
@@ -73,6 +82,7 @@ out:
 	unlock_dir(lower_dir_dentry);
 	loopfs_put_lower_path(old_dentry, &lower_old_path);
 	loopfs_put_lower_path(new_dentry, &lower_new_path);
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -83,8 +93,10 @@ static int loopfs_unlink(struct inode *dir, struct dentry *dentry)
 	struct inode *lower_dir_inode = loopfs_lower_inode(dir);
 	struct dentry *lower_dir_dentry;
 	struct path lower_path;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_unlink\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_UNLINK, dir->i_sb, dir->i_ino, 0, 0);
 
 	loopfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -119,6 +131,7 @@ out:
 	unlock_dir(lower_dir_dentry);
 	dput(lower_dentry);
 	loopfs_put_lower_path(dentry, &lower_path);
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -129,8 +142,10 @@ static int loopfs_symlink(struct inode *dir, struct dentry *dentry,
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_symlink\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_SYMLINK, dir->i_sb, dir->i_ino, 0, 0);
 
 	loopfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -150,6 +165,7 @@ static int loopfs_symlink(struct inode *dir, struct dentry *dentry,
 out:
 	unlock_dir(lower_parent_dentry);
 	loopfs_put_lower_path(dentry, &lower_path);
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -159,8 +175,10 @@ static int loopfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_mkdir\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_MKDIR, dir->i_sb, dir->i_ino, 0, 0);
 
 	loopfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -184,6 +202,7 @@ static int loopfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 out:
 	unlock_dir(lower_parent_dentry);
 	loopfs_put_lower_path(dentry, &lower_path);
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -193,8 +212,10 @@ static int loopfs_rmdir(struct inode *dir, struct dentry *dentry)
 	struct dentry *lower_dir_dentry;
 	int err;
 	struct path lower_path;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_rmdir\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_RMDIR, dir->i_sb, dir->i_ino, 0, 0);
 
 	loopfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -221,6 +242,7 @@ static int loopfs_rmdir(struct inode *dir, struct dentry *dentry)
 out:
 	unlock_dir(lower_dir_dentry);
 	loopfs_put_lower_path(dentry, &lower_path);
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -231,8 +253,10 @@ static int loopfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_mknod\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_MKNOD, dir->i_sb, dir->i_ino, 0, 0);
 
 	loopfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -253,6 +277,7 @@ static int loopfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 out:
 	unlock_dir(lower_parent_dentry);
 	loopfs_put_lower_path(dentry, &lower_path);
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -270,10 +295,13 @@ static int loopfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	struct dentry *lower_new_dir_dentry = NULL;
 	struct dentry *trap = NULL;
 	struct path lower_old_path, lower_new_path;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_rename\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_RENAME, old_dir->i_sb, old_dir->i_ino, 0, 0);
 
 	if (flags) {
+		loopfs_trace_exit(&tr, -EINVAL);
 		return -EINVAL;
 	}
 
@@ -326,9 +354,47 @@ out:
 	dput(lower_new_dir_dentry);
 	loopfs_put_lower_path(old_dentry, &lower_old_path);
 	loopfs_put_lower_path(new_dentry, &lower_new_path);
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
+/*
+ * RCU-walk symlink following: no dentry, and we must not block.  The lower
+ * inode is only freed after an RCU grace period, so its link can be handed
+ * out directly.  A lower ->get_link called with a NULL dentry returns
+ * -ECHILD if it would have to block, and the walk then retries in ref-walk.
+ *
+ * Ref-walk goes through vfs_get_link, which checks security_inode_readlink
+ * on the lower dentry.  That hook needs a dentry, so with LSMs built in
+ * the link is always left to ref-walk rather than skipping the check.
+ */
+static const char *loopfs_get_link_rcu(struct inode *inode,
+				struct delayed_call *done)
+{
+	struct inode *lower_inode;
+	const char *lower_link;
+
+	if (IS_ENABLED(CONFIG_SECURITY)) {
+		return ERR_PTR(-ECHILD);
+	}
+
+	lower_inode = READ_ONCE(LOOPFS_I(inode)->lower_inode);
+	if (!lower_inode) {
+		return ERR_PTR(-ECHILD);
+	}
+
+	lower_link = READ_ONCE(lower_inode->i_link);
+	if (lower_link) {
+		return lower_link;
+	}
+
+	if (!lower_inode->i_op->get_link) {
+		return ERR_PTR(-EINVAL);
+	}
+
+	return lower_inode->i_op->get_link(NULL, lower_inode, done);
+}
+
 static const char *loopfs_get_link(struct dentry *dentry, struct inode *inode,
 				struct delayed_call *done)
 {
@@ -337,11 +403,15 @@ static const char *loopfs_get_link(struct dentry *dentry, struct inode *inode,
 	struct path lower_path;
 	char *buf;
 	const char *lower_link;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_get_link\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_GET_LINK, inode->i_sb, inode->i_ino, 0, 0);
 
 	if (!dentry) {
-		return ERR_PTR(-ECHILD);
+		lower_link = loopfs_get_link_rcu(inode, done);
+		loopfs_trace_exit(&tr, PTR_ERR_OR_ZERO(lower_link));
+		return lower_link;
 	}
 
 	loopfs_get_lower_path(dentry, &lower_path);
@@ -373,6 +443,7 @@ static const char *loopfs_get_link(struct dentry *dentry, struct inode *inode,
 	set_delayed_call(done, kfree_link, buf);
 out:
 	loopfs_put_lower_path(dentry, &lower_path);
+	loopfs_trace_exit(&tr, PTR_ERR_OR_ZERO(buf));
 	return buf;
 }
 
@@ -380,11 +451,24 @@ static int loopfs_permission(struct inode *inode, int mask)
 {
 	struct inode *lower_inode;
 	int err;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_permission\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_PERMISSION, inode->i_sb, inode->i_ino, 0, 0);
 	
-	lower_inode = loopfs_lower_inode(inode);
-	err = inode_permission(lower_inode, mask);
+	/*
+	 * Under RCU-walk (MAY_NOT_BLOCK) the inode may be getting evicted,
+	 * which clears lower_inode.  inode_permission passes MAY_NOT_BLOCK
+	 * on to the lower ->permission and security hooks, which return
+	 * -ECHILD if they would have to block.
+	 */
+	lower_inode = READ_ONCE(LOOPFS_I(inode)->lower_inode);
+	if (!lower_inode) {
+		err = -ECHILD;
+	} else {
+		err = inode_permission(lower_inode, mask);
+	}
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -396,10 +480,13 @@ static int loopfs_setattr(struct dentry *dentry, struct iattr *ia)
 	struct inode *lower_inode;
 	struct path lower_path;
 	struct iattr lower_ia;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_setattr\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_SETATTR, dentry->d_sb, d_inode(dentry)->i_ino, 0, 0);
 
 	inode = d_inode(dentry);
+	loopfs_refresh_attr(inode);
 
 	/*
 	 * Check if user has permission to change inode.  We don't check if
@@ -470,29 +557,171 @@ static int loopfs_setattr(struct dentry *dentry, struct iattr *ia)
 out:
 	loopfs_put_lower_path(dentry, &lower_path);
 out_err:
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
+/*
+ * Copy all attributes up and remember the lower ctime, size and i_version
+ * they were taken at.  The snapshot is read first, so a change racing with
+ * the copy makes the next loopfs_attr_unchanged fail.
+ */
+static void loopfs_copy_attr_snapshot(struct inode *inode, struct inode *lower_inode)
+{
+	struct loopfs_inode_info *info = LOOPFS_I(inode);
+	struct timespec64 ctime;
+	loff_t size;
+	u64 version;
+
+	ctime = lower_inode->i_ctime;
+	size = i_size_read(lower_inode);
+	version = IS_I_VERSION(lower_inode) ? inode_query_iversion(lower_inode) : 0;
+
+	fsstack_copy_attr_all(inode, lower_inode);
+	fsstack_copy_inode_size(inode, lower_inode);
+
+	spin_lock(&inode->i_lock);
+	write_seqcount_begin(&info->lower_seq);
+	info->lower_ctime = ctime;
+	info->lower_size = size;
+	info->lower_version = version;
+	write_seqcount_end(&info->lower_seq);
+	spin_unlock(&inode->i_lock);
+}
+
+/*
+ * Every change to mode, owner, link count or times moves the lower ctime,
+ * and i_version too where the lower keeps one.  Size is compared as well
+ * because writes within one timestamp tick leave ctime alone.
+ */
+static bool loopfs_attr_unchanged(struct inode *inode, struct inode *lower_inode)
+{
+	struct loopfs_inode_info *info = LOOPFS_I(inode);
+	u64 version = IS_I_VERSION(lower_inode) ? inode_query_iversion(lower_inode) : 0;
+	struct timespec64 ctime = lower_inode->i_ctime;
+	loff_t size = i_size_read(lower_inode);
+	unsigned int seq;
+	bool ret;
+
+	/* lockless: a snapshot being rewritten just makes us retry */
+	do {
+		seq = read_seqcount_begin(&info->lower_seq);
+		ret = timespec64_equal(&info->lower_ctime, &ctime) &&
+			info->lower_size == size &&
+			info->lower_version == version;
+	} while (read_seqcount_retry(&info->lower_seq, seq));
+
+	return ret;
+}
+
+/* the fields that loopfs_attr_unchanged vouches for */
+#define	LOOPFS_SNAPSHOT_MASK	(STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | \
+				STATX_GID | STATX_ATIME | STATX_MTIME | STATX_CTIME | \
+				STATX_INO | STATX_SIZE)
+
+/*
+ * Can getattr be served from the in-core lower inode without calling the
+ * lower ->getattr?  Always with AT_STATX_DONT_SYNC, which allows stale
+ * answers.  Otherwise only when every requested field is one the snapshot
+ * vouches for: a lower ->getattr computes others itself (ext4's delalloc
+ * blocks, btime, statx attributes).  And never for lowers that revalidate
+ * their dentries (NFS, FUSE, ...) or are stacked themselves, whose in-core
+ * inode may lag what their ->getattr would return.
+ */
+static bool loopfs_getattr_cached(struct dentry *lower_dentry, u32 request_mask,
+				unsigned int flags)
+{
+	switch (flags & AT_STATX_SYNC_TYPE) {
+	case AT_STATX_DONT_SYNC:
+		return true;
+	case AT_STATX_FORCE_SYNC:
+		return false;
+	}
+
+	if (request_mask & ~LOOPFS_SNAPSHOT_MASK) {
+		return false;
+	}
+	if (lower_dentry->d_flags & (DCACHE_OP_REVALIDATE | DCACHE_OP_WEAK_REVALIDATE)) {
+		return false;
+	}
+	if (lower_dentry->d_sb->s_stack_depth) {
+		return false;
+	}
+	return true;
+}
+
 static int loopfs_getattr(const struct path *path, struct kstat *stat,
 				u32 request_mask, unsigned int flags)
 {
-	int err;
+	int err = 0;
 	struct dentry *dentry = path->dentry;
+	struct inode *inode = d_inode(dentry);
+	struct inode *lower_inode = loopfs_lower_inode(inode);
 	struct kstat lower_stat;
 	struct path lower_path;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_getattr\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_GETATTR, dentry->d_sb, inode->i_ino, 0, 0);
 
 	loopfs_get_lower_path(dentry, &lower_path);
+
+	/* file type and inode number never change, nothing to ask the lower */
+	if (!(request_mask & ~(STATX_TYPE | STATX_INO))) {
+		generic_fillattr(inode, stat);
+		stat->result_mask = STATX_TYPE | STATX_INO;
+		goto out;
+	}
+
+	loopfs_refresh_attr(inode);
+
+	if (loopfs_getattr_cached(lower_path.dentry, request_mask, flags)) {
+		if (loopfs_attr_unchanged(inode, lower_inode)) {
+			/* reads on the lower move atime without touching ctime */
+			fsstack_copy_attr_atime(inode, lower_inode);
+		} else {
+			loopfs_copy_attr_snapshot(inode, lower_inode);
+		}
+		generic_fillattr(inode, stat);
+		stat->blocks = READ_ONCE(lower_inode->i_blocks);
+		goto out;
+	}
+
+	/* only the fields asked for are fetched from the lower */
 	err = vfs_getattr(&lower_path, &lower_stat, request_mask, flags);
 	if (err) {
 		goto out;
 	}
-	fsstack_copy_attr_all(d_inode(dentry), d_inode(lower_path.dentry));
-	generic_fillattr(d_inode(dentry), stat);
+	loopfs_copy_attr_snapshot(inode, lower_inode);
+	generic_fillattr(inode, stat);
 	stat->blocks = lower_stat.blocks;
 out:
 	loopfs_put_lower_path(dentry, &lower_path);
+	loopfs_trace_exit(&tr, err);
+	return err;
+}
+
+/* extent map of the lower file, FIEMAP_FLAG_SYNC is handled by its fiemap_prep */
+static int loopfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+				u64 start, u64 len)
+{
+	int err;
+	struct inode *lower_inode;
+	struct loopfs_op_trace tr;
+
+	LDBG("loopfs_fiemap\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_FIEMAP, inode->i_sb, inode->i_ino, start, len);
+
+	lower_inode = loopfs_lower_inode(inode);
+	if (!lower_inode->i_op->fiemap) {
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+
+	err = lower_inode->i_op->fiemap(lower_inode, fieinfo, start, len);
+
+out:
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -501,8 +730,10 @@ static int loopfs_setxattr(struct dentry *dentry, struct inode *inode,
 {
 	int err; struct dentry *lower_dentry;
 	struct path lower_path;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_setxattr\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_SETXATTR, dentry->d_sb, inode->i_ino, 0, size);
 
 	loopfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -517,6 +748,7 @@ static int loopfs_setxattr(struct dentry *dentry, struct inode *inode,
 	fsstack_copy_attr_all(d_inode(dentry), d_inode(lower_path.dentry));
 out:
 	loopfs_put_lower_path(dentry, &lower_path);
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -527,8 +759,10 @@ static ssize_t loopfs_getxattr(struct dentry *dentry, struct inode *inode,
 	struct dentry *lower_dentry;
 	struct inode *lower_inode;
 	struct path lower_path;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_getxattr\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_GETXATTR, dentry->d_sb, inode->i_ino, 0, size);
 
 	loopfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -543,6 +777,7 @@ static ssize_t loopfs_getxattr(struct dentry *dentry, struct inode *inode,
 	fsstack_copy_attr_atime(d_inode(dentry), d_inode(lower_path.dentry));
 out:
 	loopfs_put_lower_path(dentry, &lower_path);
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -551,8 +786,10 @@ static ssize_t loopfs_listxattr(struct dentry *dentry, char *buffer, size_t buff
 	int err;
 	struct dentry *lower_dentry;
 	struct path lower_path;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_listxattr\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_LISTXATTR, dentry->d_sb, d_inode(dentry)->i_ino, 0, buffer_size);
 
 	loopfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -567,6 +804,7 @@ static ssize_t loopfs_listxattr(struct dentry *dentry, char *buffer, size_t buff
 	fsstack_copy_attr_atime(d_inode(dentry), d_inode(lower_path.dentry));
 out:
 	loopfs_put_lower_path(dentry, &lower_path);
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -576,8 +814,10 @@ static int loopfs_removexattr(struct dentry *dentry, struct inode *inode, const
 	struct dentry *lower_dentry;
 	struct inode *lower_inode;
 	struct path lower_path;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_removexattr\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_REMOVEXATTR, dentry->d_sb, inode->i_ino, 0, 0);
 
 	loopfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -593,6 +833,7 @@ static int loopfs_removexattr(struct dentry *dentry, struct inode *inode, const
 	fsstack_copy_attr_all(d_inode(dentry), lower_inode);
 out:
 	loopfs_put_lower_path(dentry, &lower_path);
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -626,6 +867,7 @@ const struct inode_operations loopfs_main_iops = {
 	.setattr	= loopfs_setattr,
 	.getattr	= loopfs_getattr,
 	.listxattr	= loopfs_listxattr,
+	.fiemap		= loopfs_fiemap,
 };
 
 
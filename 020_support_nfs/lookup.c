@@ -5,54 +5,93 @@ Description		: Defines for my loop filesystem look up
 ********************************************************************************/
 #include <linux/fs_stack.h>
 #include <linux/fs.h>
+#include <linux/rhashtable.h>
 
 #include "loopfs.h"
 #include "loopfs_util.h"
 
 
-static int loopfs_inode_test(struct inode *inode, void *candidate_lower_inode)
+/*
+ * Insert a fully initialized new inode into the per-sb map, or hand back
+ * the inode another lookup inserted for the same lower inode first.  The
+ * loser is not hashed, so the iput evicts it right away.
+ */
+static struct inode *loopfs_insert_inode(struct inode *inode)
 {
-	struct inode *current_lower_inode = loopfs_lower_inode(inode);
-	if (current_lower_inode == (struct inode *)candidate_lower_inode) {
-		return 1; /* found a match */
-	} else {
-		return 0; /* no match */
+	struct loopfs_sb_info *sbinfo = LOOPFS_SB(inode->i_sb);
+	struct loopfs_inode_info *old;
+	struct inode *ret;
+	int err;
+
+	rcu_read_lock();
+retry:
+	old = rhashtable_lookup_get_insert_fast(&sbinfo->inodes,
+				&LOOPFS_I(inode)->hash, loopfs_inode_params);
+	if (IS_ERR(old)) {
+		ret = ERR_CAST(old);
+		goto discard;
 	}
-}
+	if (old) {
+		if (igrab(&old->vfs_inode)) {
+			ret = &old->vfs_inode;
+			goto discard;
+		}
+		/* old is being evicted but not unhashed yet: take its place */
+		err = rhashtable_replace_fast(&sbinfo->inodes, &old->hash,
+				&LOOPFS_I(inode)->hash, loopfs_inode_params);
+		if (err == -ENOENT) {
+			goto retry;
+		}
+		if (err) {
+			ret = ERR_PTR(err);
+			goto discard;
+		}
+	}
+	rcu_read_unlock();
 
-static int loopfs_inode_set(struct inode *inode, void *lower_inode)
-{
-	/* we do actual inode initialization in loopfs_iget */
-	return 0;
+	/*
+	 * Looks hashed to generic_drop_inode, so it is kept on the LRU, but
+	 * is on no global hash chain and evict skips inode_hash_lock.
+	 */
+	inode_fake_hash(inode);
+	return inode;
+
+discard:
+	rcu_read_unlock();
+	iput(inode);
+	return ret;
 }
 
+/*
+ * Find or create the loopfs inode for lower_inode.  The per-sb map is
+ * looked up under RCU and inserts take only a bucket lock, so
+ * interposing a known inode takes no global lock; iget5_locked would
+ * serialize every mount on inode_hash_lock.  Inodes are freed after a
+ * grace period (->free_inode), which makes the igrab under RCU safe.
+ */
 struct inode *loopfs_iget(struct super_block *sb, struct inode *lower_inode)
 {
+	struct loopfs_inode_info *info;
 	struct inode *inode; /* the new inode to return */
 
+	rcu_read_lock();
+	info = rhashtable_lookup(&LOOPFS_SB(sb)->inodes, &lower_inode,
+				loopfs_inode_params);
+	if (info && igrab(&info->vfs_inode)) {
+		rcu_read_unlock();
+		return &info->vfs_inode;
+	}
+	rcu_read_unlock();
+
 	if (!igrab(lower_inode)) {
 		return ERR_PTR(-ESTALE);
 	}
 
-	inode = iget5_locked(sb, /* our superblock */
-			     /*
-			      * hashval: we use inode number, but we can
-			      * also use "(unsigned long)lower_inode"
-			      * instead.
-			      */
-			     lower_inode->i_ino, /* hashval */
-			     loopfs_inode_test,	/* inode comparison function */
-			     loopfs_inode_set, /* inode init function */
-			     lower_inode); /* data passed to test+set fxns */
+	inode = new_inode(sb);
 	if (!inode) {
 		iput(lower_inode);
 		return ERR_PTR(-ENOMEM);
 	}
-	/* if found a cached inode, then just return it (after iput) */
-	if (!(inode->i_state & I_NEW)) {
-		iput(lower_inode);
-		return inode;
-	}
 
 	/* initialize new inode */
 	inode->i_ino = lower_inode->i_ino;
@@ -76,8 +115,6 @@ struct inode *loopfs_iget(struct super_block *sb, struct inode *lower_inode)
 		inode->i_fop = &loopfs_main_fops;
 	}
 
-	// inode->i_mapping->a_ops = &loopfs_aops;
-
 	inode->i_atime.tv_sec = 0;
 	inode->i_atime.tv_nsec = 0;
 	inode->i_mtime.tv_sec = 0;
@@ -97,6 +134,5 @@ struct inode *loopfs_iget(struct super_block *sb, struct inode *lower_inode)
 	fsstack_copy_attr_all(inode, lower_inode);
 	fsstack_copy_inode_size(inode, lower_inode);
 
-	unlock_new_inode(inode);
-	return inode;
+	return loopfs_insert_inode(inode);
 }
@@ -7,29 +7,61 @@ Description		: Defines for my loop file system
 #define	__LOOP_FS_H__
 
 #include <linux/fs.h>
-#include <linux/hashtable.h>
+#include <linux/rhashtable.h>
 #include <linux/spinlock.h>
 #include <linux/mm.h>
+#include <linux/refcount.h>
+#include <linux/jump_label.h>
+#include <linux/fs_stack.h>
 
 #define LOOPFS_SUPER_MAGIC		0xb550ca10
 
+/* mount options, see loopfs_parse_options */
+#define	LOOPFS_MOUNT_BACKING_MMAP	0x0001	/* mmap maps the lower file */
+#define	LOOPFS_MOUNT_LAZYATTR		0x0002	/* see loopfs_copy_attr_write */
+
+/* default max_cached_inodes, see loopfs_drop_inode */
+#define	LOOPFS_DEFAULT_MAX_CACHED_INODES	32768
+
 /* loopfs super-block data in memory */
 struct loopfs_sb_info {
 	struct super_block *lower_sb;
-	DECLARE_HASHTABLE(hlist, 4);
-	spinlock_t hlock;
+	struct vfsmount *lower_mnt;	/* pinned for the life of the mount */
+	unsigned int mount_opts;
+	unsigned long max_cached_inodes;	/* unused inodes kept on the LRU */
+	struct rhashtable inodes;	/* lower inode -> loopfs inode, see loopfs_iget */
+	struct loopfs_stats __percpu *stats;	/* see stats.c */
+	struct dentry *debugfs_dir;
 };
 
 /* loopfs inode data in memory */
 struct loopfs_inode_info {
 	struct inode *lower_inode;
+	unsigned long flags;		/* LOOPFS_I_* bits */
+	struct rhash_head hash;		/* in loopfs_sb_info.inodes */
+	/* lower state at the last full copy-up, see loopfs_getattr */
+	seqcount_t lower_seq;		/* writers hold i_lock */
+	struct timespec64 lower_ctime;
+	loff_t lower_size;
+	u64 lower_version;
 	struct inode vfs_inode;
 };
 
+/* loopfs_sb_info.inodes is keyed by the lower inode pointer */
+static const struct rhashtable_params loopfs_inode_params = {
+	.key_len		= sizeof(struct inode *),
+	.key_offset		= offsetof(struct loopfs_inode_info, lower_inode),
+	.head_offset		= offsetof(struct loopfs_inode_info, hash),
+	.automatic_shrinking	= true,
+};
+
+/* loopfs_inode_info flags */
+#define	LOOPFS_I_ATTR_STALE	0	/* size/times not copied up yet */
+
 /* loopfs dentry data in memory */
 struct loopfs_dentry_info {
-	spinlock_t lock;	/* protects lower_path */
-	struct path lower_path;
+	struct dentry __rcu *lower_dentry;	/* holds a reference */
+	struct rcu_head rcu;	/* freed after RCU-walk is done with it */
 };
 
 /* file private data */
@@ -38,6 +70,116 @@ struct loopfs_file_info {
 	const struct vm_operations_struct *lower_vm_ops;
 };
 
+/* asynchronous lower I/O request, see loopfs_read_iter */
+struct loopfs_aio_req {
+	struct kiocb iocb;		/* cloned kiocb handed to the lower file */
+	refcount_t ref;
+	struct kiocb *orig_iocb;
+	struct file *lower_file;
+};
+
+
+/*
+ * Every VFS entry point of loopfs, as traced by the loopfs_op_enter and
+ * loopfs_op_exit tracepoints (see loopfs_trace.h).
+ */
+#define LOOPFS_OPS							\
+	EM(LOOPFS_OP_LOOKUP,		"lookup")		\
+	EM(LOOPFS_OP_CREATE,		"create")		\
+	EM(LOOPFS_OP_LINK,		"link")			\
+	EM(LOOPFS_OP_UNLINK,		"unlink")		\
+	EM(LOOPFS_OP_SYMLINK,		"symlink")		\
+	EM(LOOPFS_OP_MKDIR,		"mkdir")		\
+	EM(LOOPFS_OP_RMDIR,		"rmdir")		\
+	EM(LOOPFS_OP_MKNOD,		"mknod")		\
+	EM(LOOPFS_OP_RENAME,		"rename")		\
+	EM(LOOPFS_OP_GET_LINK,		"get_link")		\
+	EM(LOOPFS_OP_PERMISSION,	"permission")		\
+	EM(LOOPFS_OP_SETATTR,		"setattr")		\
+	EM(LOOPFS_OP_GETATTR,		"getattr")		\
+	EM(LOOPFS_OP_FIEMAP,		"fiemap")		\
+	EM(LOOPFS_OP_GETXATTR,		"getxattr")		\
+	EM(LOOPFS_OP_SETXATTR,		"setxattr")		\
+	EM(LOOPFS_OP_LISTXATTR,		"listxattr")		\
+	EM(LOOPFS_OP_REMOVEXATTR,	"removexattr")		\
+	EM(LOOPFS_OP_LLSEEK,		"llseek")		\
+	EM(LOOPFS_OP_READ_ITER,		"read_iter")		\
+	EM(LOOPFS_OP_WRITE_ITER,	"write_iter")		\
+	EM(LOOPFS_OP_IOPOLL,		"iopoll")		\
+	EM(LOOPFS_OP_READDIR,		"readdir")		\
+	EM(LOOPFS_OP_IOCTL,		"ioctl")		\
+	EM(LOOPFS_OP_COMPAT_IOCTL,	"compat_ioctl")		\
+	EM(LOOPFS_OP_MMAP,		"mmap")			\
+	EM(LOOPFS_OP_GET_UNMAPPED_AREA,	"get_unmapped_area")	\
+	EM(LOOPFS_OP_OPEN,		"open")			\
+	EM(LOOPFS_OP_FLUSH,		"flush")		\
+	EM(LOOPFS_OP_RELEASE,		"release")		\
+	EM(LOOPFS_OP_FSYNC,		"fsync")		\
+	EM(LOOPFS_OP_FASYNC,		"fasync")		\
+	EM(LOOPFS_OP_SPLICE_READ,	"splice_read")		\
+	EM(LOOPFS_OP_SPLICE_WRITE,	"splice_write")		\
+	EM(LOOPFS_OP_COPY_FILE_RANGE,	"copy_file_range")	\
+	EM(LOOPFS_OP_REMAP_FILE_RANGE,	"remap_file_range")	\
+	EM(LOOPFS_OP_FALLOCATE,		"fallocate")		\
+	EM(LOOPFS_OP_FADVISE,		"fadvise")		\
+	EM(LOOPFS_OP_FAULT,		"fault")		\
+	EM(LOOPFS_OP_HUGE_FAULT,	"huge_fault")		\
+	EM(LOOPFS_OP_PAGE_MKWRITE,	"page_mkwrite")		\
+	EM(LOOPFS_OP_PFN_MKWRITE,	"pfn_mkwrite")		\
+	EM(LOOPFS_OP_MAP_PAGES,		"map_pages")		\
+	EM(LOOPFS_OP_ALLOC_INODE,	"alloc_inode")		\
+	EM(LOOPFS_OP_EVICT_INODE,	"evict_inode")		\
+	EM(LOOPFS_OP_PUT_SUPER,		"put_super")		\
+	EM(LOOPFS_OP_STATFS,		"statfs")		\
+	EM(LOOPFS_OP_REMOUNT_FS,	"remount_fs")		\
+	EM(LOOPFS_OP_UMOUNT_BEGIN,	"umount_begin")		\
+	EM(LOOPFS_OP_SHOW_OPTIONS,	"show_options")		\
+	EM(LOOPFS_OP_FH_TO_DENTRY,	"fh_to_dentry")		\
+	EMe(LOOPFS_OP_FH_TO_PARENT,	"fh_to_parent")
+
+#undef EM
+#undef EMe
+#define EM(a, b)	a,
+#define EMe(a, b)	a,
+
+enum loopfs_op {
+	LOOPFS_OPS
+	LOOPFS_OP_NR
+};
+
+#undef EM
+#undef EMe
+
+/* one traced call of a loopfs operation, see loopfs_trace_enter */
+struct loopfs_op_trace {
+	enum loopfs_op op;
+	struct super_block *sb;
+	unsigned long ino;
+	loff_t pos;
+	u64 len;
+	u64 start;		/* ktime_get_ns() at entry, 0 if not timed */
+};
+
+/*
+ * Per-cpu operation statistics of one mount.  Bucket i of lat counts the
+ * calls that took [2^i, 2^(i+1)) ns; the last bucket also takes anything
+ * slower.
+ */
+#define	LOOPFS_LAT_BUCKETS	32
+
+struct loopfs_op_stats {
+	u64 count;
+	u64 errors;
+	u64 total_ns;
+	u64 lat[LOOPFS_LAT_BUCKETS];
+};
+
+struct loopfs_stats {
+	struct loopfs_op_stats op[LOOPFS_OP_NR];
+};
+
+extern struct static_key_false loopfs_stats_key;
+
 
 
 /*
@@ -55,6 +197,8 @@ static inline struct loopfs_inode_info *LOOPFS_I(const struct inode *inode)
 /* superblock to private data */
 #define LOOPFS_SB(super) ((struct loopfs_sb_info *)(super)->s_fs_info)
 
+#define loopfs_test_opt(sb, opt)	(LOOPFS_SB(sb)->mount_opts & LOOPFS_MOUNT_##opt)
+
 /* dentry to private data */
 #define LOOPFS_D(dent) ((struct loopfs_dentry_info *)(dent)->d_fsdata)
 
@@ -84,7 +228,65 @@ static inline struct inode *loopfs_lower_inode(const struct inode *i)
 
 static inline void loopfs_set_lower_inode(struct inode *i, struct inode *val)
 {
-	LOOPFS_I(i)->lower_inode = val;
+	/* read locklessly by RCU-walk, see loopfs_permission */
+	WRITE_ONCE(LOOPFS_I(i)->lower_inode, val);
+}
+
+/*
+ * Attribute propagation on the data path.  By default every read copies
+ * the lower atime up and every write the lower size and times.  With the
+ * lazyattr mount option the data path only marks the inode stale, which
+ * after the first I/O is a read of a shared cache line, and
+ * loopfs_refresh_attr copies the attributes up when someone looks at
+ * them: getattr, setattr, open, fsync and close.  A write that changes
+ * the size refreshes right away, see loopfs_copy_attr_write.
+ */
+static inline void loopfs_mark_attr_stale(struct inode *inode)
+{
+	if (!test_bit(LOOPFS_I_ATTR_STALE, &LOOPFS_I(inode)->flags)) {
+		set_bit(LOOPFS_I_ATTR_STALE, &LOOPFS_I(inode)->flags);
+	}
+}
+
+static inline void loopfs_refresh_attr(struct inode *inode)
+{
+	struct inode *lower_inode = loopfs_lower_inode(inode);
+
+	/* clear first: a write that completes after this marks it again */
+	if (test_bit(LOOPFS_I_ATTR_STALE, &LOOPFS_I(inode)->flags) &&
+			test_and_clear_bit(LOOPFS_I_ATTR_STALE, &LOOPFS_I(inode)->flags)) {
+		fsstack_copy_inode_size(inode, lower_inode);
+		fsstack_copy_attr_times(inode, lower_inode);
+	}
+}
+
+static inline void loopfs_copy_attr_read(struct inode *inode,
+				struct inode *lower_inode)
+{
+	if (loopfs_test_opt(inode->i_sb, LAZYATTR)) {
+		loopfs_mark_attr_stale(inode);
+	} else {
+		fsstack_copy_attr_atime(inode, lower_inode);
+	}
+}
+
+static inline void loopfs_copy_attr_write(struct inode *inode,
+				struct inode *lower_inode)
+{
+	if (loopfs_test_opt(inode->i_sb, LAZYATTR)) {
+		loopfs_mark_attr_stale(inode);
+		/*
+		 * The size cannot wait: vfs_copy_file_range clamps the length
+		 * to the upper i_size before any loopfs op is called, so a
+		 * stale size cuts copies short.  Overwrites skip this.
+		 */
+		if (i_size_read(inode) != i_size_read(lower_inode)) {
+			loopfs_refresh_attr(inode);
+		}
+	} else {
+		fsstack_copy_inode_size(inode, lower_inode);
+		fsstack_copy_attr_times(inode, lower_inode);
+	}
 }
 
 /* path based (dentry/mnt) macros */
@@ -94,51 +296,50 @@ static inline void pathcpy(struct path *dst, const struct path *src)
 	dst->mnt = src->mnt;
 }
 
-/* Returns struct path.  Caller must path_put it. */
-static inline void loopfs_get_lower_path(const struct dentry *dent,
-					struct path *lower_path)
+/*
+ * The lower dentry is set once at lookup and only cleared by d_release, so
+ * it is stable for as long as the caller holds a reference on dent.
+ * RCU-walk, which holds none, uses rcu_dereference instead.
+ */
+static inline struct dentry *loopfs_lower_dentry(const struct dentry *dent)
 {
-	spin_lock(&LOOPFS_D(dent)->lock);
-	pathcpy(lower_path, &LOOPFS_D(dent)->lower_path);
-	path_get(lower_path);
-	spin_unlock(&LOOPFS_D(dent)->lock);
-	return;
+	return rcu_dereference_protected(LOOPFS_D(dent)->lower_dentry, 1);
 }
 
-static inline void loopfs_put_lower_path(const struct dentry *dent,
+/*
+ * Returns struct path.  Takes no references: the lower dentry is pinned
+ * by dent and the lower mount by the superblock, so the path is valid
+ * while the caller holds dent.  Callers that keep it beyond that must
+ * path_get it themselves.
+ */
+static inline void loopfs_get_lower_path(const struct dentry *dent,
 					struct path *lower_path)
 {
-	path_put(lower_path);
+	lower_path->dentry = loopfs_lower_dentry(dent);
+	lower_path->mnt = LOOPFS_SB(dent->d_sb)->lower_mnt;
 	return;
 }
 
-static inline void loopfs_set_lower_path(const struct dentry *dent,
+static inline void loopfs_put_lower_path(const struct dentry *dent,
 					struct path *lower_path)
 {
-	spin_lock(&LOOPFS_D(dent)->lock);
-	pathcpy(&LOOPFS_D(dent)->lower_path, lower_path);
-	spin_unlock(&LOOPFS_D(dent)->lock);
 	return;
 }
 
-static inline void loopfs_reset_lower_path(const struct dentry *dent)
+/* takes over the caller's reference on lower_dentry */
+static inline void loopfs_set_lower_dentry(const struct dentry *dent,
+					struct dentry *lower_dentry)
 {
-	spin_lock(&LOOPFS_D(dent)->lock);
-	LOOPFS_D(dent)->lower_path.dentry = NULL;
-	LOOPFS_D(dent)->lower_path.mnt = NULL;
-	spin_unlock(&LOOPFS_D(dent)->lock);
+	rcu_assign_pointer(LOOPFS_D(dent)->lower_dentry, lower_dentry);
 	return;
 }
 
-static inline void loopfs_put_reset_lower_path(const struct dentry *dent)
+static inline void loopfs_put_reset_lower_dentry(const struct dentry *dent)
 {
-	struct path lower_path;
-	spin_lock(&LOOPFS_D(dent)->lock);
-	pathcpy(&lower_path, &LOOPFS_D(dent)->lower_path);
-	LOOPFS_D(dent)->lower_path.dentry = NULL;
-	LOOPFS_D(dent)->lower_path.mnt = NULL;
-	spin_unlock(&LOOPFS_D(dent)->lock);
-	path_put(&lower_path);
+	struct dentry *lower_dentry = loopfs_lower_dentry(dent);
+
+	RCU_INIT_POINTER(LOOPFS_D(dent)->lower_dentry, NULL);
+	dput(lower_dentry);
 	return;
 }
 
@@ -187,7 +388,6 @@ extern const struct inode_operations loopfs_dir_iops;
 extern const struct inode_operations loopfs_main_iops;
 extern const struct file_operations loopfs_main_fops;
 extern const struct file_operations loopfs_dir_fops;
-extern const struct address_space_operations loopfs_aops;
 extern const struct vm_operations_struct loopfs_vm_ops;
 extern const struct export_operations loopfs_export_ops;
 extern const struct xattr_handler *loopfs_xattr_handlers[];
@@ -197,6 +397,14 @@ extern int loopfs_init_inode_cache(void);
 extern void loopfs_destroy_inode_cache(void);
 extern int loopfs_init_dentry_cache(void);
 extern void loopfs_destroy_dentry_cache(void);
+extern int loopfs_init_aio_cache(void);
+extern void loopfs_destroy_aio_cache(void);
+extern void loopfs_init_stats(void);
+extern void loopfs_destroy_stats(void);
+extern int loopfs_stats_alloc(struct super_block *sb);
+extern void loopfs_stats_free(struct super_block *sb);
+extern void loopfs_stats_account(struct super_block *sb, enum loopfs_op op,
+				long ret, u64 delta_ns);
 extern int new_dentry_private_data(struct dentry *dentry);
 extern void free_dentry_private_data(struct dentry *dentry);
 
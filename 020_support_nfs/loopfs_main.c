@@ -7,10 +7,14 @@ Description		: my loop file sytem main routine
 #include <linux/fs.h>
 #include <linux/namei.h>
 #include <linux/slab.h>
+#include <linux/parser.h>
 
 #include "loopfs.h"
 #include "loopfs_util.h"
 
+#define CREATE_TRACE_POINTS
+#include "loopfs_trace.h"
+
 
 #define	LOOPFS_VERSION_STRING		"loopfs_0.01"
 
@@ -20,11 +24,56 @@ Description		: my loop file sytem main routine
 #define	LOOPFS_MODULE_AUTHOR		"Stephen.Yang <71696209@qq.com>"
 
 
+/* one static key per LDBG class, see loopfs_util.h */
+DEFINE_STATIC_KEY_ARRAY_FALSE(loopfs_dbg_keys, LOOPFS_DBG_NR);
+
+static unsigned int loopfs_debug;
+
+static int loopfs_debug_set(const char *val, const struct kernel_param *kp)
+{
+	int err;
+	int i;
+	unsigned int mask;
+
+	err = kstrtouint(val, 0, &mask);
+	if (err) {
+		return err;
+	}
+	mask &= BIT(LOOPFS_DBG_NR) - 1;
+
+	for (i = 0; i < LOOPFS_DBG_NR; i++) {
+		if (mask & BIT(i)) {
+			static_branch_enable(&loopfs_dbg_keys[i]);
+		} else {
+			static_branch_disable(&loopfs_dbg_keys[i]);
+		}
+	}
+	loopfs_debug = mask;
+
+	return 0;
+}
+
+static const struct kernel_param_ops loopfs_debug_ops = {
+	.set	= loopfs_debug_set,
+	.get	= param_get_uint,
+};
+
+module_param_cb(debug, &loopfs_debug_ops, &loopfs_debug, 0644);
+MODULE_PARM_DESC(debug, "Debug output mask: 0x01 mount, 0x02 super, "
+		"0x04 lookup/dentry, 0x08 inode, 0x10 file, 0x20 mmap");
+
+
 static struct dentry* loopfs_mount(struct file_system_type *fs_type,
 									int flags,
 									const char *dev_name,
 									void *data);
 
+/* what loopfs_mount hands to loopfs_fill_super_block */
+struct loopfs_mount_data {
+	const char *dev_name;
+	char *options;
+};
+
 
 static struct file_system_type loopfs_fstype =
 {
@@ -51,12 +100,76 @@ static void loopfs_read_super_block(struct super_block *sb)
 	LDBG("file system active = %u\n", sb->s_active.counter);
 }
 
+enum {
+	Opt_backing_mmap,
+	Opt_lazyattr,
+	Opt_max_cached_inodes,
+	Opt_err,
+};
+
+static const match_table_t loopfs_tokens = {
+	{Opt_backing_mmap,	"backing_mmap"},
+	{Opt_lazyattr,		"lazyattr"},
+	{Opt_max_cached_inodes,	"max_cached_inodes=%u"},
+	{Opt_err,			NULL},
+};
+
+/*
+ * Parse the comma separated mount options into sbinfo->mount_opts.
+ *
+ * backing_mmap:	mmap maps the lower file directly, see loopfs_backing_mmap
+ * lazyattr:		copy times up on demand, see loopfs_copy_attr_write
+ * max_cached_inodes=N:	keep at most N unused inodes cached, see
+ *			loopfs_drop_inode.  0 evicts them on their last iput.
+ */
+static int loopfs_parse_options(struct loopfs_sb_info *sbinfo, char *options)
+{
+	char *p;
+	int token, n;
+	substring_t args[MAX_OPT_ARGS];
+
+	sbinfo->max_cached_inodes = LOOPFS_DEFAULT_MAX_CACHED_INODES;
+
+	if (!options) {
+		return 0;
+	}
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p) {
+			continue;
+		}
+
+		token = match_token(p, loopfs_tokens, args);
+		switch (token) {
+		case Opt_backing_mmap:
+			sbinfo->mount_opts |= LOOPFS_MOUNT_BACKING_MMAP;
+			break;
+		case Opt_lazyattr:
+			sbinfo->mount_opts |= LOOPFS_MOUNT_LAZYATTR;
+			break;
+		case Opt_max_cached_inodes:
+			if (match_int(&args[0], &n) || n < 0) {
+				LERR("invalid max_cached_inodes \"%s\".\n", p);
+				return -EINVAL;
+			}
+			sbinfo->max_cached_inodes = n;
+			break;
+		default:
+			LERR("unrecognized mount option \"%s\".\n", p);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
 static int loopfs_fill_super_block(struct super_block *sb, void *raw_data, int silent)
 {
 	int err = 0;
 	struct super_block *lower_sb;
 	struct path lower_path;
-	char *dev_name = (char *)raw_data;
+	struct loopfs_mount_data *mount_data = raw_data;
+	const char *dev_name = mount_data->dev_name;
 	struct inode *inode;
 
 	if (!dev_name) {
@@ -80,9 +193,30 @@ static int loopfs_fill_super_block(struct super_block *sb, void *raw_data, int s
 		goto out_free;
 	}
 
-	/* initialize internal hash list */
-	hash_init(LOOPFS_SB(sb)->hlist);
-	spin_lock_init(&LOOPFS_SB(sb)->hlock);
+	err = loopfs_parse_options(LOOPFS_SB(sb), mount_data->options);
+	if (err) {
+		kfree(LOOPFS_SB(sb));
+		sb->s_fs_info = NULL;
+		goto out_free;
+	}
+
+	/* lower inode to loopfs inode map, see loopfs_iget */
+	err = rhashtable_init(&LOOPFS_SB(sb)->inodes, &loopfs_inode_params);
+	if (err) {
+		kfree(LOOPFS_SB(sb));
+		sb->s_fs_info = NULL;
+		goto out_free;
+	}
+
+	/* per mount operation counters, see stats.c */
+	err = loopfs_stats_alloc(sb);
+	if (err) {
+		LERR("loopfs_fill_super_block: out of memory\n");
+		rhashtable_destroy(&LOOPFS_SB(sb)->inodes);
+		kfree(LOOPFS_SB(sb));
+		sb->s_fs_info = NULL;
+		goto out_free;
+	}
 
 	/* set the lower superblock field of upper superblock */
 	lower_sb = lower_path.dentry->d_sb;
@@ -126,8 +260,12 @@ static int loopfs_fill_super_block(struct super_block *sb, void *raw_data, int s
 
 	/* if get here: cannot have error */
 
-	/* set the lower dentries for s_root */
-	loopfs_set_lower_path(sb->s_root, &lower_path);
+	/*
+	 * s_root keeps the lower root dentry and the superblock the lower
+	 * mount; both references come from kern_path above.
+	 */
+	LOOPFS_SB(sb)->lower_mnt = lower_path.mnt;
+	loopfs_set_lower_dentry(sb->s_root, lower_path.dentry);
 
 	/*
 	 * No need to call interpose because we already have a positive
@@ -156,6 +294,8 @@ out_iput:
 out_sput:
 	/* drop refs we took earlier */
 	atomic_dec(&lower_sb->s_active);
+	loopfs_stats_free(sb);
+	rhashtable_destroy(&LOOPFS_SB(sb)->inodes);
 	kfree(LOOPFS_SB(sb));
 	sb->s_fs_info = NULL;
 out_free:
@@ -170,10 +310,13 @@ static struct dentry* loopfs_mount(struct file_system_type *fs_type,
 									const char *dev_name,
 									void *data)
 {
-	void *low_path = (void *)dev_name;
+	struct loopfs_mount_data mount_data = {
+		.dev_name	= dev_name,
+		.options	= data,
+	};
 	LDBG("Mount entry, dev name: %s.\n", dev_name);
 
-	return mount_nodev(fs_type, flags, low_path, loopfs_fill_super_block);
+	return mount_nodev(fs_type, flags, &mount_data, loopfs_fill_super_block);
 }
 
 
@@ -188,14 +331,21 @@ static int __init init_loopfs(void)
 	err = loopfs_init_dentry_cache();
 	if (err) goto out;
 
+	err = loopfs_init_aio_cache();
+	if (err) goto out;
+
+	loopfs_init_stats();
+
 	err = (register_filesystem(&loopfs_fstype));
 	if (err) goto out;
 
 	return err;
 
 out:
+	loopfs_destroy_stats();
 	loopfs_destroy_inode_cache();
 	loopfs_destroy_dentry_cache();
+	loopfs_destroy_aio_cache();
 	return err;
 }
 
@@ -211,6 +361,10 @@ static void __exit exit_loopfs(void)
 	LDBG("Module exit! Unregister file system.\n");
 
 	unregister_filesystem(&loopfs_fstype);
+	loopfs_destroy_aio_cache();
+	loopfs_destroy_stats();
+	loopfs_destroy_inode_cache();
+	loopfs_destroy_dentry_cache();
 }
 
 /**
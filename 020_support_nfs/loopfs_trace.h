@@ -0,0 +1,146 @@
+/********************************************************************************
+File			: loopfs_trace.h
+Description		: Tracepoints for my loop filesystem operations
+
+********************************************************************************/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM loopfs
+
+#if !defined(__LOOP_FS_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __LOOP_FS_TRACE_H__
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+
+#include "loopfs.h"
+
+/* export the operation names to user space tools */
+#undef EM
+#undef EMe
+#define EM(a, b)	TRACE_DEFINE_ENUM(a);
+#define EMe(a, b)	TRACE_DEFINE_ENUM(a);
+
+LOOPFS_OPS
+
+#undef EM
+#undef EMe
+#define EM(a, b)	{ a, b },
+#define EMe(a, b)	{ a, b }
+
+#define show_loopfs_op(op)	__print_symbolic(op, LOOPFS_OPS)
+
+/* lower superblock of a loopfs superblock, 0 before mount or after umount */
+#define loopfs_trace_lower_dev(sb)					\
+	((sb) && LOOPFS_SB(sb) && LOOPFS_SB(sb)->lower_sb ?		\
+		LOOPFS_SB(sb)->lower_sb->s_dev : 0)
+
+TRACE_EVENT(loopfs_op_enter,
+	TP_PROTO(const struct loopfs_op_trace *t),
+
+	TP_ARGS(t),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	op)
+		__field(dev_t,		lower_dev)
+		__field(unsigned long,	ino)
+		__field(loff_t,		pos)
+		__field(u64,		len)
+	),
+
+	TP_fast_assign(
+		__entry->op		= t->op;
+		__entry->lower_dev	= loopfs_trace_lower_dev(t->sb);
+		__entry->ino		= t->ino;
+		__entry->pos		= t->pos;
+		__entry->len		= t->len;
+	),
+
+	TP_printk("%s lower_dev=%d:%d ino=%lu pos=%lld len=%llu",
+		show_loopfs_op(__entry->op),
+		MAJOR(__entry->lower_dev), MINOR(__entry->lower_dev),
+		__entry->ino, __entry->pos, __entry->len)
+);
+
+TRACE_EVENT(loopfs_op_exit,
+	TP_PROTO(const struct loopfs_op_trace *t, long ret, u64 delta_ns),
+
+	TP_ARGS(t, ret, delta_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	op)
+		__field(dev_t,		lower_dev)
+		__field(unsigned long,	ino)
+		__field(loff_t,		pos)
+		__field(u64,		len)
+		__field(long,		ret)
+		__field(u64,		delta_ns)
+	),
+
+	TP_fast_assign(
+		__entry->op		= t->op;
+		__entry->lower_dev	= loopfs_trace_lower_dev(t->sb);
+		__entry->ino		= t->ino;
+		__entry->pos		= t->pos;
+		__entry->len		= t->len;
+		__entry->ret		= ret;
+		__entry->delta_ns	= delta_ns;
+	),
+
+	TP_printk("%s lower_dev=%d:%d ino=%lu pos=%lld len=%llu ret=%ld delta_ns=%llu",
+		show_loopfs_op(__entry->op),
+		MAJOR(__entry->lower_dev), MINOR(__entry->lower_dev),
+		__entry->ino, __entry->pos, __entry->len,
+		__entry->ret, __entry->delta_ns)
+);
+
+#endif	// __LOOP_FS_TRACE_H__
+
+
+#ifndef	__LOOP_FS_TRACE_HELPERS__
+#define	__LOOP_FS_TRACE_HELPERS__
+
+/*
+ * Called at the top of every loopfs operation.  The clock is only read
+ * when the call is timed for the per-mount statistics or for the exit
+ * tracepoint; with both off this costs a few stores to the stack and
+ * patched-out jumps.
+ */
+static inline void loopfs_trace_enter(struct loopfs_op_trace *t,
+				enum loopfs_op op, struct super_block *sb,
+				unsigned long ino, loff_t pos, u64 len)
+{
+	t->op = op;
+	t->sb = sb;
+	t->ino = ino;
+	t->pos = pos;
+	t->len = len;
+	t->start = (static_branch_unlikely(&loopfs_stats_key) ||
+			trace_loopfs_op_exit_enabled()) ? ktime_get_ns() : 0;
+	trace_loopfs_op_enter(t);
+}
+
+/* called right before the operation returns @ret */
+static inline void loopfs_trace_exit(struct loopfs_op_trace *t, long ret)
+{
+	u64 delta_ns;
+
+	if (!t->start) {
+		return;
+	}
+
+	delta_ns = ktime_get_ns() - t->start;
+	trace_loopfs_op_exit(t, ret, delta_ns);
+	if (static_branch_unlikely(&loopfs_stats_key)) {
+		loopfs_stats_account(t->sb, t->op, ret, delta_ns);
+	}
+}
+
+#endif	// __LOOP_FS_TRACE_HELPERS__
+
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE loopfs_trace
+#include <trace/define_trace.h>
@@ -6,17 +6,41 @@ Description		: Defines for my loop filesystem utilities
 #ifndef	__LOOP_FS_UTIL_H__
 #define	__LOOP_FS_UTIL_H__
 
+#include <linux/jump_label.h>
+#include <linux/printk.h>
+#include <linux/ratelimit.h>
 
-#define	LOOPFS_DEBUG
 
-#ifdef	LOOPFS_DEBUG
-	#define	LDBG(msg, args...) do {									\
-		printk(KERN_INFO "<LOOPFS> " msg, ##args);										\
-	} while(0)
-#else
-	#define	LDBG(msg, args...) do { } while(0)
+/*
+ * Debug output is split into classes which are switched on and off at
+ * runtime through the "debug" module parameter (a mask of the bits
+ * below), e.g. echo 0x10 > /sys/module/loopfs/parameters/debug.
+ * A disabled class costs one patched-out jump; an enabled one is rate
+ * limited.  A .c file picks its class by defining LOOPFS_DBG_CLASS
+ * before including this header.
+ */
+enum loopfs_dbg_class {
+	LOOPFS_DBG_MAIN,	/* 0x01: module, mount */
+	LOOPFS_DBG_SUPER,	/* 0x02: super_operations, NFS export */
+	LOOPFS_DBG_DENTRY,	/* 0x04: lookup, dentry_operations */
+	LOOPFS_DBG_INODE,	/* 0x08: inode_operations, xattr */
+	LOOPFS_DBG_FILE,	/* 0x10: file_operations */
+	LOOPFS_DBG_MMAP,	/* 0x20: vm_operations, address_space */
+	LOOPFS_DBG_NR,
+};
+
+extern struct static_key_false loopfs_dbg_keys[LOOPFS_DBG_NR];
+
+#ifndef	LOOPFS_DBG_CLASS
+	#define	LOOPFS_DBG_CLASS	LOOPFS_DBG_MAIN
 #endif
 
+#define	LDBG(msg, args...) do {										\
+	if (static_branch_unlikely(&loopfs_dbg_keys[LOOPFS_DBG_CLASS])) {		\
+		printk_ratelimited(KERN_INFO "<LOOPFS> " msg, ##args);					\
+	}																\
+} while(0)
+
 #define	LERR(msg, args...) do {										\
 	printk(KERN_ERR "<LOOPFS> " msg, ##args);											\
 } while(0)
@@ -1,5 +1,8 @@
+#define	LOOPFS_DBG_CLASS	LOOPFS_DBG_MMAP
+
 #include "loopfs.h"
 #include "loopfs_util.h"
+#include "loopfs_trace.h"
 
 
 
@@ -10,8 +13,11 @@ static vm_fault_t loopfs_fault(struct vm_fault *vmf)
 	struct file *file, *lower_file;
 	const struct vm_operations_struct *lower_vm_ops;
 	struct vm_area_struct lower_vma;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_fault\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_FAULT, file_inode(vma->vm_file)->i_sb, file_inode(vma->vm_file)->i_ino,
+			(loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE);
 
 	memcpy(&lower_vma, vma, sizeof(struct vm_area_struct));
 	file = lower_vma.vm_file;
@@ -33,6 +39,7 @@ static vm_fault_t loopfs_fault(struct vm_fault *vmf)
 	vmf->vma = &lower_vma; /* override vma temporarily */
 	err = lower_vm_ops->fault(vmf);
 	vmf->vma = vma; /* restore vma*/
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -43,8 +50,11 @@ static vm_fault_t loopfs_page_mkwrite(struct vm_fault *vmf)
 	struct file *file, *lower_file;
 	const struct vm_operations_struct *lower_vm_ops;
 	struct vm_area_struct lower_vma;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_page_mkwrite\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_PAGE_MKWRITE, file_inode(vma->vm_file)->i_sb, file_inode(vma->vm_file)->i_ino,
+			(loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE);
 
 	memcpy(&lower_vma, vma, sizeof(struct vm_area_struct));
 	file = lower_vma.vm_file;
@@ -71,25 +81,142 @@ static vm_fault_t loopfs_page_mkwrite(struct vm_fault *vmf)
 	err = lower_vm_ops->page_mkwrite(vmf);
 	vmf->vma = vma; /* restore vma */
 out:
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
-static ssize_t loopfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+/*
+ * Write fault on a read-only pfn mapping, which is how DAX lowers map
+ * persistent memory.  The lower must see it to track the dirty range for
+ * fsync, so there is no default here.
+ */
+static vm_fault_t loopfs_pfn_mkwrite(struct vm_fault *vmf)
 {
-	LDBG("loopfs_page_mkwrite\n");
+	vm_fault_t err = 0;
+	struct vm_area_struct *vma = vmf->vma;
+	struct file *file;
+	const struct vm_operations_struct *lower_vm_ops;
+	struct vm_area_struct lower_vma;
+	struct loopfs_op_trace tr;
+
+	LDBG("loopfs_pfn_mkwrite\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_PFN_MKWRITE, file_inode(vma->vm_file)->i_sb, file_inode(vma->vm_file)->i_ino,
+			(loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE);
+
+	memcpy(&lower_vma, vma, sizeof(struct vm_area_struct));
+	file = lower_vma.vm_file;
+	lower_vm_ops = LOOPFS_F(file)->lower_vm_ops;
+	BUG_ON(!lower_vm_ops);
+	if (!lower_vm_ops->pfn_mkwrite) {
+		goto out;
+	}
+
+	/* same stack copy of the vma as in loopfs_fault */
+	lower_vma.vm_file = loopfs_lower_file(file);
+	vmf->vma = &lower_vma; /* override vma temporarily */
+	err = lower_vm_ops->pfn_mkwrite(vmf);
+	vmf->vma = vma; /* restore vma */
+out:
+	loopfs_trace_exit(&tr, err);
+	return err;
+}
+
+/*
+ * PMD/PUD sized faults, only DAX lowers implement them.  A huge page of a
+ * tmpfs lower is mapped by the regular ->fault path once the mapping is
+ * aligned by loopfs_get_unmapped_area.
+ */
+/* bytes mapped by one entry of pe_size, for the trace/stats len */
+static u64 loopfs_pe_bytes(enum page_entry_size pe_size)
+{
+	switch (pe_size) {
+	case PE_SIZE_PMD:
+		return PMD_SIZE;
+	case PE_SIZE_PUD:
+		return PUD_SIZE;
+	default:
+		return PAGE_SIZE;
+	}
+}
+
+static vm_fault_t loopfs_huge_fault(struct vm_fault *vmf,
+				enum page_entry_size pe_size)
+{
+	vm_fault_t err = VM_FAULT_FALLBACK;
+	struct vm_area_struct *vma = vmf->vma;
+	struct file *file;
+	const struct vm_operations_struct *lower_vm_ops;
+	struct vm_area_struct lower_vma;
+	struct loopfs_op_trace tr;
+
+	LDBG("loopfs_huge_fault\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_HUGE_FAULT, file_inode(vma->vm_file)->i_sb, file_inode(vma->vm_file)->i_ino,
+			(loff_t)vmf->pgoff << PAGE_SHIFT, loopfs_pe_bytes(pe_size));
+
+	memcpy(&lower_vma, vma, sizeof(struct vm_area_struct));
+	file = lower_vma.vm_file;
+	lower_vm_ops = LOOPFS_F(file)->lower_vm_ops;
+	BUG_ON(!lower_vm_ops);
+	if (!lower_vm_ops->huge_fault) {
+		goto out;
+	}
+
+	/* same stack copy of the vma as in loopfs_fault */
+	lower_vma.vm_file = loopfs_lower_file(file);
+	vmf->vma = &lower_vma; /* override vma temporarily */
+	err = lower_vm_ops->huge_fault(vmf, pe_size);
+	vmf->vma = vma; /* restore vma */
+out:
+	loopfs_trace_exit(&tr, err);
+	return err;
+}
+
+/*
+ * Fault-around: map the lower pages that are already in the page cache
+ * around the faulting address, so that a scan of a cached file takes one
+ * fault per fault_around_bytes window instead of one per page.
+ */
+static vm_fault_t loopfs_map_pages(struct vm_fault *vmf, pgoff_t start_pgoff,
+				pgoff_t end_pgoff)
+{
+	vm_fault_t ret = 0;
+	struct vm_area_struct *vma = vmf->vma;
+	struct file *file;
+	const struct vm_operations_struct *lower_vm_ops;
+	struct vm_area_struct lower_vma;
+	struct loopfs_op_trace tr;
+
+	LDBG("loopfs_map_pages\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_MAP_PAGES, file_inode(vma->vm_file)->i_sb, file_inode(vma->vm_file)->i_ino,
+			(loff_t)start_pgoff << PAGE_SHIFT, (u64)(end_pgoff - start_pgoff + 1) << PAGE_SHIFT);
+
+	memcpy(&lower_vma, vma, sizeof(struct vm_area_struct));
+	file = lower_vma.vm_file;
+	lower_vm_ops = LOOPFS_F(file)->lower_vm_ops;
+	BUG_ON(!lower_vm_ops);
+	if (!lower_vm_ops->map_pages) {
+		goto out;
+	}
+
 	/*
-	 * This function should never be called directly.  We need it
-	 * to exist, to get past a check in open_check_o_direct(),
-	 * which is called from do_last().
+	 * filemap_map_pages looks up the pages in vma->vm_file->f_mapping,
+	 * so it must see the lower file.  Same stack copy of the vma as in
+	 * loopfs_fault.
 	 */
-	return -EINVAL;
+	lower_vma.vm_file = loopfs_lower_file(file);
+	vmf->vma = &lower_vma; /* override vma temporarily */
+	/* VM_FAULT_NOPAGE if the faulting page itself got mapped */
+	ret = lower_vm_ops->map_pages(vmf, start_pgoff, end_pgoff);
+	vmf->vma = vma; /* restore vma */
+out:
+	loopfs_trace_exit(&tr, ret);
+	return ret;
 }
 
-const struct address_space_operations loopfs_aops = {
-	.direct_IO = loopfs_direct_IO,
-};
-
 const struct vm_operations_struct loopfs_vm_ops = {
 	.fault			= loopfs_fault,
+	.huge_fault		= loopfs_huge_fault,
+	.map_pages		= loopfs_map_pages,
 	.page_mkwrite	= loopfs_page_mkwrite,
+	.pfn_mkwrite	= loopfs_pfn_mkwrite,
 };
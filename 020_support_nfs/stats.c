@@ -0,0 +1,212 @@
+/********************************************************************************
+File			: stats.c
+Description		: Per mount operation counters and latency histograms
+
+********************************************************************************/
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#define	LOOPFS_DBG_CLASS	LOOPFS_DBG_SUPER
+
+#include "loopfs.h"
+#include "loopfs_util.h"
+
+
+/*
+ * Every loopfs operation timed by loopfs_trace_enter/loopfs_trace_exit is
+ * accounted here in per-cpu counters of its superblock, so the hot path
+ * takes no lock and shares no cache line.  The counters are summed over
+ * all cpus only when debugfs is read:
+ *
+ *   /sys/kernel/debug/loopfs/<major>:<minor>/stats	one line per operation
+ *   /sys/kernel/debug/loopfs/<major>:<minor>/reset	write anything to clear
+ *
+ * <major>:<minor> is the st_dev of the loopfs mount.  Timing costs two
+ * clock reads per operation, so it is off unless the "stats" module
+ * parameter is set to 1; the files stay at zero until then.
+ */
+
+DEFINE_STATIC_KEY_FALSE(loopfs_stats_key);
+
+static int loopfs_stats_set(const char *val, const struct kernel_param *kp)
+{
+	int err;
+	bool on;
+
+	err = kstrtobool(val, &on);
+	if (err) {
+		return err;
+	}
+
+	if (on) {
+		static_branch_enable(&loopfs_stats_key);
+	} else {
+		static_branch_disable(&loopfs_stats_key);
+	}
+
+	return 0;
+}
+
+static int loopfs_stats_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%c\n",
+		static_key_enabled(&loopfs_stats_key) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops loopfs_stats_ops = {
+	.set	= loopfs_stats_set,
+	.get	= loopfs_stats_get,
+};
+
+module_param_cb(stats, &loopfs_stats_ops, NULL, 0644);
+MODULE_PARM_DESC(stats, "Keep per mount operation counters and latency "
+		"histograms in debugfs (default: N)");
+
+
+#undef EM
+#undef EMe
+#define EM(a, b)	[a] = b,
+#define EMe(a, b)	[a] = b,
+
+static const char * const loopfs_op_names[LOOPFS_OP_NR] = {
+	LOOPFS_OPS
+};
+
+#undef EM
+#undef EMe
+
+
+static struct dentry *loopfs_debugfs_root;
+
+void loopfs_init_stats(void)
+{
+	loopfs_debugfs_root = debugfs_create_dir("loopfs", NULL);
+}
+
+void loopfs_destroy_stats(void)
+{
+	debugfs_remove_recursive(loopfs_debugfs_root);
+	loopfs_debugfs_root = NULL;
+}
+
+
+void loopfs_stats_account(struct super_block *sb, enum loopfs_op op,
+				long ret, u64 delta_ns)
+{
+	struct loopfs_sb_info *sbi = sb ? LOOPFS_SB(sb) : NULL;
+	unsigned int bucket;
+
+	/* put_super frees the counters before its own call is accounted */
+	if (!sbi || !sbi->stats) {
+		return;
+	}
+
+	bucket = delta_ns ? ilog2(delta_ns) : 0;
+	if (bucket >= LOOPFS_LAT_BUCKETS) {
+		bucket = LOOPFS_LAT_BUCKETS - 1;
+	}
+
+	this_cpu_inc(sbi->stats->op[op].count);
+	this_cpu_add(sbi->stats->op[op].total_ns, delta_ns);
+	this_cpu_inc(sbi->stats->op[op].lat[bucket]);
+	if (ret < 0) {
+		this_cpu_inc(sbi->stats->op[op].errors);
+	}
+}
+
+
+/*
+ * One line per operation:
+ *   <op> <count> <errors> <total_ns> <lat[0]> ... <lat[LOOPFS_LAT_BUCKETS - 1]>
+ */
+static int loopfs_stats_show(struct seq_file *m, void *v)
+{
+	struct super_block *sb = m->private;
+	struct loopfs_sb_info *sbi = LOOPFS_SB(sb);
+	struct loopfs_op_stats sum;
+	struct loopfs_op_stats *st;
+	int op, cpu, i;
+
+	for (op = 0; op < LOOPFS_OP_NR; op++) {
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			st = &per_cpu_ptr(sbi->stats, cpu)->op[op];
+			sum.count += READ_ONCE(st->count);
+			sum.errors += READ_ONCE(st->errors);
+			sum.total_ns += READ_ONCE(st->total_ns);
+			for (i = 0; i < LOOPFS_LAT_BUCKETS; i++) {
+				sum.lat[i] += READ_ONCE(st->lat[i]);
+			}
+		}
+
+		seq_printf(m, "%s %llu %llu %llu", loopfs_op_names[op],
+			sum.count, sum.errors, sum.total_ns);
+		for (i = 0; i < LOOPFS_LAT_BUCKETS; i++) {
+			seq_printf(m, " %llu", sum.lat[i]);
+		}
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(loopfs_stats);
+
+static ssize_t loopfs_stats_reset_write(struct file *file,
+				const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct super_block *sb = file_inode(file)->i_private;
+	struct loopfs_sb_info *sbi = LOOPFS_SB(sb);
+	int cpu;
+
+	LDBG("loopfs_stats_reset_write\n");
+
+	/* counters bumped concurrently on other cpus may survive the reset */
+	for_each_possible_cpu(cpu) {
+		memset(per_cpu_ptr(sbi->stats, cpu), 0, sizeof(struct loopfs_stats));
+	}
+
+	return count;
+}
+
+static const struct file_operations loopfs_stats_reset_fops = {
+	.owner	= THIS_MODULE,
+	.open	= simple_open,
+	.write	= loopfs_stats_reset_write,
+	.llseek	= noop_llseek,
+};
+
+
+/* called from fill_super once s_fs_info is set up */
+int loopfs_stats_alloc(struct super_block *sb)
+{
+	struct loopfs_sb_info *sbi = LOOPFS_SB(sb);
+	char name[32];
+
+	sbi->stats = alloc_percpu(struct loopfs_stats);
+	if (!sbi->stats) {
+		return -ENOMEM;
+	}
+
+	snprintf(name, sizeof(name), "%u:%u", MAJOR(sb->s_dev), MINOR(sb->s_dev));
+	sbi->debugfs_dir = debugfs_create_dir(name, loopfs_debugfs_root);
+	debugfs_create_file("stats", 0444, sbi->debugfs_dir, sb, &loopfs_stats_fops);
+	debugfs_create_file("reset", 0200, sbi->debugfs_dir, sb, &loopfs_stats_reset_fops);
+
+	return 0;
+}
+
+void loopfs_stats_free(struct super_block *sb)
+{
+	struct loopfs_sb_info *sbi = LOOPFS_SB(sb);
+
+	/* waits for readers of the debugfs files to go away */
+	debugfs_remove_recursive(sbi->debugfs_dir);
+	sbi->debugfs_dir = NULL;
+
+	free_percpu(sbi->stats);
+	sbi->stats = NULL;
+}
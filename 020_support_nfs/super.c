@@ -9,9 +9,13 @@ Description		: Defines for my loop filesystem super block
 #include <linux/mount.h>
 #include <linux/statfs.h>
 #include <linux/exportfs.h>
+#include <linux/seq_file.h>
+
+#define	LOOPFS_DBG_CLASS	LOOPFS_DBG_SUPER
 
 #include "loopfs.h"
 #include "loopfs_util.h"
+#include "loopfs_trace.h"
 
 
 
@@ -46,6 +50,8 @@ int loopfs_init_inode_cache(void)
 /* loopfs inode cache destructor */
 void loopfs_destroy_inode_cache(void)
 {
+	/* wait for the RCU-delayed loopfs_free_inode calls */
+	rcu_barrier();
 	if (loopfs_inode_cachep)
 		kmem_cache_destroy(loopfs_inode_cachep);
 }
@@ -54,24 +60,33 @@ void loopfs_destroy_inode_cache(void)
 static struct inode *loopfs_alloc_inode(struct super_block *sb)
 {
 	struct loopfs_inode_info *i;
+	struct loopfs_op_trace tr;
+
 	LDBG("loopfs_alloc_inode\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_ALLOC_INODE, sb, 0, 0, 0);
 
 	i = kmem_cache_alloc(loopfs_inode_cachep, GFP_KERNEL);
 	if (!i) {
+		loopfs_trace_exit(&tr, -ENOMEM);
 		return NULL;
 	}
 
 	/* memset everything up to the inode to 0 */
 	memset(i, 0, offsetof(struct loopfs_inode_info, vfs_inode));
+	seqcount_init(&i->lower_seq);
 
 	atomic64_set(&i->vfs_inode.i_version, 1);
+	loopfs_trace_exit(&tr, 0);
 	return &i->vfs_inode;
 }
 
-static void loopfs_destroy_inode(struct inode *inode)
+/*
+ * Called after an RCU grace period, RCU-walk may look at the inode until
+ * then.  Not traced: it can run after put_super freed the per-sb stats.
+ */
+static void loopfs_free_inode(struct inode *inode)
 {
-	LDBG("loopfs_destroy_inode\n");
-	
+	LDBG("loopfs_free_inode\n");
 	kmem_cache_free(loopfs_inode_cachep, LOOPFS_I(inode));
 }
 
@@ -84,9 +99,19 @@ static void loopfs_destroy_inode(struct inode *inode)
 static void loopfs_evict_inode(struct inode *inode)
 {
 	struct inode *lower_inode;
+	struct loopfs_op_trace tr;
+
+	loopfs_trace_enter(&tr, LOOPFS_OP_EVICT_INODE, inode->i_sb, inode->i_ino, 0, 0);
 
 	truncate_inode_pages(&inode->i_data, 0);
 	clear_inode(inode);
+
+	/*
+	 * Unhash before the key is cleared.  -ENOENT is fine: loopfs_iget
+	 * may have replaced us already, or never inserted a losing duplicate.
+	 */
+	rhashtable_remove_fast(&LOOPFS_SB(inode->i_sb)->inodes,
+			&LOOPFS_I(inode)->hash, loopfs_inode_params);
 	/*
 	 * Decrement a reference to a lower_inode, which was incremented
 	 * by our read_inode when it was created initially.
@@ -94,6 +119,31 @@ static void loopfs_evict_inode(struct inode *inode)
 	lower_inode = loopfs_lower_inode(inode);
 	loopfs_set_lower_inode(inode, NULL);
 	iput(lower_inode);
+	loopfs_trace_exit(&tr, 0);
+}
+
+/*
+ * Called by iput() with i_lock held when the last reference goes away.
+ * Returning 0 keeps the inode hashed on the superblock's inode LRU, so
+ * the next lookup of the file finds it in loopfs_iget instead of building
+ * it again; the sb shrinker evicts it under memory pressure.
+ *
+ * A cached inode pins its lower inode, so drop it right away when the
+ * lower file is unlinked or we are over max_cached_inodes.
+ */
+static int loopfs_drop_inode(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct inode *lower_inode = loopfs_lower_inode(inode);
+
+	if (!lower_inode || !lower_inode->i_nlink) {
+		return 1;
+	}
+	if (list_lru_count(&sb->s_inode_lru) >= LOOPFS_SB(sb)->max_cached_inodes) {
+		return 1;
+	}
+
+	return generic_drop_inode(inode);
 }
 
 /* final actions when unmounting a file system */
@@ -101,14 +151,25 @@ static void loopfs_put_super(struct super_block *sb)
 {
 	struct loopfs_sb_info *spd;
 	struct super_block *s;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_put_super\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_PUT_SUPER, sb, 0, 0, 0);
 
 	spd = LOOPFS_SB(sb);
 	if (!spd) {
+		loopfs_trace_exit(&tr, 0);
 		return;
 	}
 
+	loopfs_stats_free(sb);
+
+	/* evict_inodes has emptied it */
+	rhashtable_destroy(&spd->inodes);
+
+	/* all dentries are gone, and with them the last lower path users */
+	mntput(spd->lower_mnt);
+
 	/* decrement lower super references */
 	s = loopfs_lower_super(sb);
 	loopfs_set_lower_super(sb, NULL);
@@ -116,14 +177,17 @@ static void loopfs_put_super(struct super_block *sb)
 
 	kfree(spd);
 	sb->s_fs_info = NULL;
+	loopfs_trace_exit(&tr, 0);
 }
 
 static int loopfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
 	int err = 0;	
 	struct path lower_path;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_statfs\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_STATFS, dentry->d_sb, d_inode(dentry)->i_ino, 0, 0);
 
 	loopfs_get_lower_path(dentry, &lower_path);
 	err = vfs_statfs(&lower_path, buf);
@@ -132,6 +196,7 @@ static int loopfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	/* set return buf to our f/s to avoid confusing user-level utils */
 	buf->f_type = LOOPFS_SUPER_MAGIC;
 
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -142,8 +207,10 @@ static int loopfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 static int loopfs_remount_fs(struct super_block *sb, int *flags, char *options)
 {
 	int err = 0;
+	struct loopfs_op_trace tr;
 
 	LDBG("loopfs_remount_fs: remount flags 0x%x.\n", *flags);
+	loopfs_trace_enter(&tr, LOOPFS_OP_REMOUNT_FS, sb, 0, 0, *flags);
 	/*
 	 * The VFS will take care of "ro" and "rw" flags among others.  We
 	 * can safely accept a few flags (RDONLY, MANDLOCK), and honor
@@ -154,6 +221,7 @@ static int loopfs_remount_fs(struct super_block *sb, int *flags, char *options)
 		err = -EINVAL;
 	}
 
+	loopfs_trace_exit(&tr, err);
 	return err;
 }
 
@@ -163,19 +231,47 @@ static int loopfs_remount_fs(struct super_block *sb, int *flags, char *options)
  */
 static void loopfs_umount_begin(struct super_block *sb)
 {
+	struct loopfs_op_trace tr;
+
 	LDBG("loopfs_umount_begin\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_UMOUNT_BEGIN, sb, 0, 0, 0);
+	loopfs_trace_exit(&tr, 0);
+}
+
+/* mount options for /proc/mounts, see loopfs_parse_options */
+static int loopfs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct super_block *sb = root->d_sb;
+	struct loopfs_op_trace tr;
+
+	LDBG("loopfs_show_options\n");
+	loopfs_trace_enter(&tr, LOOPFS_OP_SHOW_OPTIONS, sb, 0, 0, 0);
+
+	if (loopfs_test_opt(sb, BACKING_MMAP)) {
+		seq_puts(m, ",backing_mmap");
+	}
+	if (loopfs_test_opt(sb, LAZYATTR)) {
+		seq_puts(m, ",lazyattr");
+	}
+	if (LOOPFS_SB(sb)->max_cached_inodes != LOOPFS_DEFAULT_MAX_CACHED_INODES) {
+		seq_printf(m, ",max_cached_inodes=%lu", LOOPFS_SB(sb)->max_cached_inodes);
+	}
+
+	loopfs_trace_exit(&tr, 0);
+	return 0;
 }
 
 
 const struct super_operations loopfs_sops = {
 	.alloc_inode	= loopfs_alloc_inode,
-	.destroy_inode	= loopfs_destroy_inode, /* first called when umount */
-	.drop_inode		= generic_delete_inode,
+	.free_inode		= loopfs_free_inode, /* first called when umount */
+	.drop_inode		= loopfs_drop_inode,
 	.evict_inode	= loopfs_evict_inode,
 	.put_super		= loopfs_put_super, /* secondly called when umount */
 	.statfs			= loopfs_statfs,
 	.remount_fs		= loopfs_remount_fs,
 	.umount_begin	= loopfs_umount_begin,
+	.show_options	= loopfs_show_options,
 };
 
 
@@ -201,15 +297,29 @@ static struct inode *loopfs_nfs_get_inode(struct super_block *sb, u64 ino,
 static struct dentry *loopfs_fh_to_dentry(struct super_block *sb,
 				struct fid *fid, int fh_len, int fh_type)
 {
+	struct dentry *ret;
+	struct loopfs_op_trace tr;
+
 	LDBG("loopfs_fh_to_dentry\n");
-	return generic_fh_to_dentry(sb, fid, fh_len, fh_type, loopfs_nfs_get_inode);
+	loopfs_trace_enter(&tr, LOOPFS_OP_FH_TO_DENTRY, sb, 0, 0, fh_len);
+
+	ret = generic_fh_to_dentry(sb, fid, fh_len, fh_type, loopfs_nfs_get_inode);
+	loopfs_trace_exit(&tr, PTR_ERR_OR_ZERO(ret));
+	return ret;
 }
 
 static struct dentry *loopfs_fh_to_parent(struct super_block *sb,
 				struct fid *fid, int fh_len, int fh_type)
 {
+	struct dentry *ret;
+	struct loopfs_op_trace tr;
+
 	LDBG("loopfs_fh_to_parent\n");
-	return generic_fh_to_parent(sb, fid, fh_len, fh_type, loopfs_nfs_get_inode);
+	loopfs_trace_enter(&tr, LOOPFS_OP_FH_TO_PARENT, sb, 0, 0, fh_len);
+
+	ret = generic_fh_to_parent(sb, fid, fh_len, fh_type, loopfs_nfs_get_inode);
+	loopfs_trace_exit(&tr, PTR_ERR_OR_ZERO(ret));
+	return ret;
 }
 
 /*
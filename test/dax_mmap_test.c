@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "dbg_define.h"
+
+/*
+ * usage: dax_mmap_test <file on loopfs> <same file on lower fs>
+ *
+ * The lower must be ext4 or xfs mounted with -o dax.  pmem can be
+ * emulated by booting with memmap=4G!12G (4 GiB at 12 GiB) and then:
+ *
+ *   mkfs.ext4 /dev/pmem0 && mount -o dax /dev/pmem0 <lower dir>
+ *
+ * Checks that loopfs reports the file as DAX, that a MAP_SYNC mapping
+ * (only possible on DAX) can be created through loopfs, and that stores
+ * through it are seen by a read of the lower file.
+ *
+ * On a non-DAX lower (tmpfs, ext4 without -o dax) it checks instead that
+ * MAP_SYNC is refused with EOPNOTSUPP.  Run it on both a default and a
+ * backing_mmap loopfs mount.
+ */
+
+#ifndef MAP_SHARED_VALIDATE
+#define	MAP_SHARED_VALIDATE	0x03
+#endif
+#ifndef MAP_SYNC
+#define	MAP_SYNC	0x80000
+#endif
+#ifndef STATX_ATTR_DAX
+#define	STATX_ATTR_DAX	0x00200000
+#endif
+
+#define	MAP_SIZE	(2 * 1024 * 1024)
+
+static int is_dax(const char *path)
+{
+	struct statx stx;
+
+	if (statx(AT_FDCWD, path, 0, STATX_BASIC_STATS, &stx)) {
+		perror("statx failed.");
+		return -1;
+	}
+	return !!(stx.stx_attributes & STATX_ATTR_DAX);
+}
+
+/* a MAP_SYNC mapping of a non-DAX file must fail with EOPNOTSUPP */
+static int check_no_map_sync(int fd)
+{
+	char *map;
+
+	map = mmap(NULL, MAP_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED_VALIDATE | MAP_SYNC, fd, 0);
+	if (map != MAP_FAILED) {
+		xxprint("MAP_SYNC mmap of a non-DAX file succeeded\n");
+		munmap(map, MAP_SIZE);
+		return 1;
+	}
+	if (errno != EOPNOTSUPP) {
+		perror("MAP_SYNC mmap failed, but not with EOPNOTSUPP.");
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char *map, *buf;
+	int fd, lower_fd;
+	int i, err = 0;
+
+	if (argc != 3) {
+		xxprint("usage: %s <loopfs file> <lower file>\n", argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, MAP_SIZE)) {
+		perror("open failed.");
+		return 1;
+	}
+
+	xxprint("dax: upper %d, lower %d\n", is_dax(argv[1]), is_dax(argv[2]));
+	if (is_dax(argv[2]) == 0) {
+		err = check_no_map_sync(fd);
+		close(fd);
+		xxprint("%s\n", err ? "FAILED" : "PASSED");
+		return err;
+	}
+	if (is_dax(argv[1]) != 1) {
+		err = 1;
+	}
+
+	map = mmap(NULL, MAP_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED_VALIDATE | MAP_SYNC, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("MAP_SYNC mmap failed.");
+		close(fd);
+		xxprint("FAILED\n");
+		return 1;
+	}
+
+	for (i = 0; i < MAP_SIZE; i += 4096) {
+		map[i] = (char)(i >> 12);
+	}
+
+	buf = malloc(MAP_SIZE);
+	lower_fd = open(argv[2], O_RDONLY);
+	if (!buf || lower_fd < 0 || pread(lower_fd, buf, MAP_SIZE, 0) != MAP_SIZE) {
+		perror("lower read failed.");
+		err = 1;
+	} else if (memcmp(buf, map, MAP_SIZE)) {
+		xxprint("lower file differs from the mapping\n");
+		err = 1;
+	}
+
+	munmap(map, MAP_SIZE);
+	free(buf);
+	if (lower_fd >= 0) {
+		close(lower_fd);
+	}
+	close(fd);
+	xxprint("%s\n", err ? "FAILED" : "PASSED");
+	return err;
+}
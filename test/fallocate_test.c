@@ -0,0 +1,88 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dbg_define.h"
+
+/*
+ * usage: fallocate_test <file on loopfs> <same file on lower fs>
+ *
+ * Preallocates, punches a hole and zeroes a range through loopfs, and
+ * checks after each step that stat() on loopfs reports the same size and
+ * block count as the lower file.
+ */
+
+#define	MB	(1024 * 1024)
+
+static int check_blocks(const char *step, const char *upper, const char *lower)
+{
+	struct stat ust, lst;
+
+	if (stat(upper, &ust) || stat(lower, &lst)) {
+		perror("stat failed.");
+		return -1;
+	}
+
+	xxprint("%-12s upper: size %lld blocks %lld, lower: size %lld blocks %lld\n",
+		step, (long long)ust.st_size, (long long)ust.st_blocks,
+		(long long)lst.st_size, (long long)lst.st_blocks);
+
+	if (ust.st_size != lst.st_size || ust.st_blocks != lst.st_blocks) {
+		xxprint("%s: MISMATCH\n", step);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int fd;
+	int err = 0;
+
+	if (argc != 3) {
+		xxprint("usage: %s <loopfs file> <lower file>\n", argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("open failed.");
+		return 1;
+	}
+
+	if (fallocate(fd, 0, 0, 16 * MB)) {
+		perror("fallocate failed.");
+		err = 1;
+		goto out;
+	}
+	err |= check_blocks("preallocate", argv[1], argv[2]);
+
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 4 * MB, 4 * MB)) {
+		perror("punch hole failed.");
+		err = 1;
+		goto out;
+	}
+	err |= check_blocks("punch hole", argv[1], argv[2]);
+
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 16 * MB, 4 * MB)) {
+		perror("keep size failed.");
+		err = 1;
+		goto out;
+	}
+	err |= check_blocks("keep size", argv[1], argv[2]);
+
+	if (fallocate(fd, FALLOC_FL_ZERO_RANGE, 8 * MB, 2 * MB)) {
+		perror("zero range failed.");
+	} else {
+		err |= check_blocks("zero range", argv[1], argv[2]);
+	}
+
+out:
+	close(fd);
+	xxprint("%s\n", err ? "FAILED" : "PASSED");
+	return err ? 1 : 0;
+}
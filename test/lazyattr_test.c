@@ -0,0 +1,82 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dbg_define.h"
+
+/*
+ * usage: lazyattr_test <dir on a loopfs mount with -o lazyattr>
+ *
+ * Appends to a file through loopfs, without closing or syncing it, and
+ * checks that fstat() and copy_file_range() see the new data right away.
+ * vfs_copy_file_range clamps the length to the loopfs i_size before loopfs
+ * is called, so a size left stale by lazyattr made it return 0 or a short
+ * count for the appended bytes.
+ */
+
+#define	BS	4096
+#define	NBLOCKS	4
+
+int main(int argc, char *argv[])
+{
+	char src_path[4096], dst_path[4096];
+	char buf[BS], check[BS];
+	struct stat st;
+	loff_t in, out;
+	ssize_t ret;
+	int src, dst, i;
+	int err = 0;
+
+	if (argc != 2) {
+		xxprint("usage: %s <dir on lazyattr loopfs>\n", argv[0]);
+		return 1;
+	}
+
+	snprintf(src_path, sizeof(src_path), "%s/lazyattr_src", argv[1]);
+	snprintf(dst_path, sizeof(dst_path), "%s/lazyattr_dst", argv[1]);
+	src = open(src_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	dst = open(dst_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (src < 0 || dst < 0) {
+		perror("open failed.");
+		return 1;
+	}
+
+	for (i = 0; i < NBLOCKS; i++) {
+		memset(buf, 'a' + i, BS);
+		if (write(src, buf, BS) != BS) {
+			perror("write failed.");
+			return 1;
+		}
+
+		if (fstat(src, &st) || st.st_size != (off_t)(i + 1) * BS) {
+			xxprint("block %d: st_size %lld, want %d\n", i,
+				(long long)st.st_size, (i + 1) * BS);
+			err = 1;
+		}
+
+		/* copy the block just appended, src still open and unsynced */
+		in = (loff_t)i * BS;
+		out = (loff_t)i * BS;
+		ret = copy_file_range(src, &in, dst, &out, BS, 0);
+		if (ret != BS) {
+			xxprint("block %d: copy_file_range returned %zd, want %d\n", i, ret, BS);
+			err = 1;
+			continue;
+		}
+		if (pread(dst, check, BS, (off_t)i * BS) != BS || memcmp(buf, check, BS)) {
+			xxprint("block %d: copied data differs\n", i);
+			err = 1;
+		}
+	}
+
+	close(src);
+	close(dst);
+	unlink(src_path);
+	unlink(dst_path);
+	xxprint("%s\n", err ? "FAILED" : "PASSED");
+	return err;
+}
@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dbg_define.h"
+
+/*
+ * usage: mmap_fault_bench <file>
+ *
+ * Reads the whole file once to bring it into the page cache, then maps
+ * it and touches one byte per page.  Prints the minor faults and time
+ * taken by the scan.  Run it on a 1 GiB file through loopfs and on the
+ * same file on the lower file system:
+ *
+ *   dd if=/dev/zero of=<lower dir>/big bs=1M count=1024
+ *   mmap_fault_bench <loopfs dir>/big
+ *   mmap_fault_bench <lower dir>/big
+ *
+ * With fault-around the number of faults is about size / fault_around_bytes
+ * (64 KiB by default) rather than size / page size.
+ */
+
+#define	BUF_SIZE	(1024 * 1024)
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long minor_faults(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_minflt;
+}
+
+int main(int argc, char *argv[])
+{
+	struct stat st;
+	char *buf, *map;
+	volatile char sink;
+	unsigned long long start, total_ns;
+	long page_size, faults;
+	off_t off;
+	int fd;
+
+	if (argc != 2) {
+		xxprint("usage: %s <file>\n", argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror("open failed.");
+		return 1;
+	}
+	if (st.st_size == 0) {
+		xxprint("%s: empty file\n", argv[1]);
+		return 1;
+	}
+	page_size = sysconf(_SC_PAGESIZE);
+
+	/* warm the page cache so that every fault finds its page */
+	buf = malloc(BUF_SIZE);
+	if (!buf) {
+		return 1;
+	}
+	while (read(fd, buf, BUF_SIZE) > 0) {
+		;
+	}
+	free(buf);
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap failed.");
+		return 1;
+	}
+
+	faults = minor_faults();
+	start = now_ns();
+	for (off = 0; off < st.st_size; off += page_size) {
+		sink = map[off];
+	}
+	total_ns = now_ns() - start;
+	faults = minor_faults() - faults;
+	(void)sink;
+
+	xxprint("%s: %lld pages, %ld minor faults, %.1f pages/fault, %llu us\n",
+		argv[1], (long long)((st.st_size + page_size - 1) / page_size), faults,
+		faults ? (double)st.st_size / page_size / faults : 0.0, total_ns / 1000);
+
+	munmap(map, st.st_size);
+	close(fd);
+	return 0;
+}
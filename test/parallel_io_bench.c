@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dbg_define.h"
+
+/*
+ * usage: parallel_io_bench <file> [-w] [seconds per step]
+ *
+ * 1, 2, 4, ... 64 threads doing random 4 KiB pread()s (pwrite()s with -w)
+ * on one shared, cached file.  Prints the total throughput at each thread
+ * count.  Run it on a loopfs file with and without the lazyattr mount
+ * option, and on the lower file.
+ *
+ * build: gcc -O2 -o parallel_io_bench parallel_io_bench.c -lpthread
+ */
+
+#define	BS		4096
+#define	MAX_THREADS	64
+
+static int fd;
+static int do_write;
+static long nblocks;
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	unsigned int seed;
+	long ops;
+	char buf[BS] __attribute__((aligned(64)));
+};
+
+static struct worker workers[MAX_THREADS];
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	off_t off;
+	ssize_t ret;
+
+	while (!stop) {
+		off = (off_t)(rand_r(&w->seed) % nblocks) * BS;
+		if (do_write) {
+			ret = pwrite(fd, w->buf, BS, off);
+		} else {
+			ret = pread(fd, w->buf, BS, off);
+		}
+		if (ret != BS) {
+			perror("I/O failed.");
+			exit(1);
+		}
+		w->ops++;
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct stat st;
+	struct timespec step;
+	long total, i;
+	int nr, seconds = 2;
+	char *buf;
+
+	if (argc > 2 && !strcmp(argv[2], "-w")) {
+		do_write = 1;
+		argv[2] = argv[1];
+		argv++;
+		argc--;
+	}
+	if (argc < 2) {
+		xxprint("usage: %s <file> [-w] [seconds per step]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2) {
+		seconds = atoi(argv[2]);
+	}
+
+	fd = open(argv[1], do_write ? O_RDWR : O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror("open failed.");
+		return 1;
+	}
+	nblocks = st.st_size / BS;
+	if (nblocks < 1) {
+		xxprint("%s: file must be at least %d bytes\n", argv[1], BS);
+		return 1;
+	}
+
+	/* warm the page cache */
+	buf = malloc(BS);
+	for (i = 0; buf && i < nblocks; i++) {
+		if (pread(fd, buf, BS, (off_t)i * BS) < 0) {
+			perror("pread failed.");
+			return 1;
+		}
+	}
+	free(buf);
+
+	for (nr = 1; nr <= MAX_THREADS; nr *= 2) {
+		stop = 0;
+		for (i = 0; i < nr; i++) {
+			workers[i].seed = i + 1;
+			workers[i].ops = 0;
+			memset(workers[i].buf, 'x', BS);
+			pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]);
+		}
+
+		step.tv_sec = seconds;
+		step.tv_nsec = 0;
+		nanosleep(&step, NULL);
+		stop = 1;
+
+		total = 0;
+		for (i = 0; i < nr; i++) {
+			pthread_join(workers[i].thread, NULL);
+			total += workers[i].ops;
+		}
+
+		xxprint("%s: %s %2d threads, %10.0f ops/s, %8.0f ops/s/thread\n", argv[1],
+			do_write ? "pwrite" : "pread", nr, (double)total / seconds,
+			(double)total / seconds / nr);
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dbg_define.h"
+
+/*
+ * usage: path_walk_bench <dir> [seconds per step]
+ *
+ * Builds <dir>/d0/d1/.../d7/file plus a symlink <dir>/link -> d0/d1/.../d7,
+ * then runs 1, 2, 4, ... 64 threads doing stat() on "<dir>/d0/.../d7/file"
+ * and "<dir>/link/file" in turn.  Prints the total stat()s per second at
+ * each thread count.  If path walk stays in RCU mode the rate scales with
+ * the threads; if it falls back to ref-walk the shared dentry refcounts
+ * make it flatten out.  Run it on a loopfs dir and on the lower dir.
+ *
+ * build: gcc -O2 -o path_walk_bench path_walk_bench.c -lpthread
+ */
+
+#define	DEPTH		8
+#define	MAX_THREADS	64
+
+static char deep_path[4096];
+static char link_path[4096];
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	long ops;
+} __attribute__((aligned(64)));
+
+static struct worker workers[MAX_THREADS];
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	struct stat st;
+
+	while (!stop) {
+		if (stat((w->ops & 1) ? link_path : deep_path, &st)) {
+			perror("stat failed.");
+			exit(1);
+		}
+		w->ops++;
+	}
+
+	return NULL;
+}
+
+static int build_tree(const char *dir)
+{
+	char target[4096];
+	int i, n, fd;
+
+	n = snprintf(deep_path, sizeof(deep_path), "%s", dir);
+	target[0] = '\0';
+	for (i = 0; i < DEPTH; i++) {
+		n += snprintf(deep_path + n, sizeof(deep_path) - n, "/d%d", i);
+		if (mkdir(deep_path, 0755) && access(deep_path, F_OK)) {
+			perror("mkdir failed.");
+			return -1;
+		}
+		snprintf(target + strlen(target), sizeof(target) - strlen(target),
+				"%sd%d", i ? "/" : "", i);
+	}
+
+	snprintf(link_path, sizeof(link_path), "%s/link", dir);
+	unlink(link_path);
+	if (symlink(target, link_path)) {
+		perror("symlink failed.");
+		return -1;
+	}
+	strncat(link_path, "/file", sizeof(link_path) - strlen(link_path) - 1);
+
+	snprintf(deep_path + n, sizeof(deep_path) - n, "/file");
+	fd = open(deep_path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		perror("create failed.");
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct timespec step;
+	long total, i;
+	int nr, seconds = 2;
+
+	if (argc < 2) {
+		xxprint("usage: %s <dir> [seconds per step]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2) {
+		seconds = atoi(argv[2]);
+	}
+
+	if (build_tree(argv[1])) {
+		return 1;
+	}
+
+	for (nr = 1; nr <= MAX_THREADS; nr *= 2) {
+		stop = 0;
+		for (i = 0; i < nr; i++) {
+			workers[i].ops = 0;
+			pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]);
+		}
+
+		step.tv_sec = seconds;
+		step.tv_nsec = 0;
+		nanosleep(&step, NULL);
+		stop = 1;
+
+		total = 0;
+		for (i = 0; i < nr; i++) {
+			pthread_join(workers[i].thread, NULL);
+			total += workers[i].ops;
+		}
+
+		xxprint("%s: %2d threads, %10.0f stat/s, %8.0f stat/s/thread\n", argv[1],
+			nr, (double)total / seconds, (double)total / seconds / nr);
+	}
+
+	return 0;
+}
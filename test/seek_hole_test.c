@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "dbg_define.h"
+
+/*
+ * usage: seek_hole_test <file on loopfs> <same file on lower fs>
+ *
+ * Creates a 1 GiB sparse file with four 1 MiB data extents through loopfs
+ * and checks that SEEK_DATA/SEEK_HOLE and FIEMAP see the same layout on
+ * loopfs as on the lower file.  Also checks that read() continues from
+ * the offset SEEK_DATA returned.
+ */
+
+#define	MB	(1024 * 1024LL)
+#define	GB	(1024 * MB)
+
+static const long long data_off[] = { 0, 100 * MB, 512 * MB, GB - MB };
+
+/* "data@off-end" list of the file, walked with SEEK_DATA/SEEK_HOLE */
+static int walk_seek(const char *path, char *out, size_t size)
+{
+	off_t data, hole = 0;
+	int fd, n = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("open failed.");
+		return -1;
+	}
+
+	out[0] = '\0';
+	while ((data = lseek(fd, hole, SEEK_DATA)) >= 0) {
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0) {
+			break;
+		}
+		n += snprintf(out + n, size - n, " %lld-%lld", (long long)data, (long long)hole);
+	}
+
+	close(fd);
+	return 0;
+}
+
+static int count_extents(const char *path)
+{
+	struct fiemap fm;
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+
+	memset(&fm, 0, sizeof(fm));
+	fm.fm_length = FIEMAP_MAX_OFFSET;
+	fm.fm_flags = FIEMAP_FLAG_SYNC;
+	err = ioctl(fd, FS_IOC_FIEMAP, &fm);
+	close(fd);
+
+	return err ? -1 : (int)fm.fm_mapped_extents;
+}
+
+int main(int argc, char *argv[])
+{
+	char upper_map[512], lower_map[512];
+	char *buf;
+	char c;
+	int fd, i, upper_ext, lower_ext;
+	int err = 0;
+
+	if (argc != 3) {
+		xxprint("usage: %s <loopfs file> <lower file>\n", argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	buf = malloc(MB);
+	if (fd < 0 || !buf || ftruncate(fd, GB)) {
+		perror("create failed.");
+		return 1;
+	}
+	memset(buf, 'x', MB);
+	for (i = 0; i < (int)(sizeof(data_off) / sizeof(data_off[0])); i++) {
+		if (pwrite(fd, buf, MB, data_off[i]) != MB) {
+			perror("pwrite failed.");
+			return 1;
+		}
+	}
+	fsync(fd);
+
+	/* the file position must follow SEEK_DATA for the next read */
+	if (lseek(fd, MB, SEEK_DATA) != 100 * MB || read(fd, &c, 1) != 1 || c != 'x' ||
+			lseek(fd, 0, SEEK_CUR) != 100 * MB + 1) {
+		xxprint("file position does not follow SEEK_DATA\n");
+		err = 1;
+	}
+	close(fd);
+
+	if (walk_seek(argv[1], upper_map, sizeof(upper_map)) ||
+			walk_seek(argv[2], lower_map, sizeof(lower_map))) {
+		return 1;
+	}
+	xxprint("upper:%s\nlower:%s\n", upper_map, lower_map);
+	if (strcmp(upper_map, lower_map)) {
+		xxprint("SEEK_DATA/SEEK_HOLE: MISMATCH\n");
+		err = 1;
+	}
+
+	upper_ext = count_extents(argv[1]);
+	lower_ext = count_extents(argv[2]);
+	xxprint("fiemap extents: upper %d, lower %d\n", upper_ext, lower_ext);
+	if (upper_ext != lower_ext) {
+		xxprint("FIEMAP: MISMATCH\n");
+		err = 1;
+	}
+
+	free(buf);
+	xxprint("%s\n", err ? "FAILED" : "PASSED");
+	return err;
+}
@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dbg_define.h"
+
+/*
+ * usage: small_read_bench <file> [ops] [-w]
+ *
+ * Syscall overhead of 512 byte pread()s (pwrite()s with -w) on a file
+ * whose pages are in the page cache.  Run it on a loopfs file and on the
+ * same lower file; the difference is the per-call cost of loopfs.
+ */
+
+#define	IO_SIZE		512
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	char buf[IO_SIZE];
+	struct stat st;
+	unsigned long long start, total_ns;
+	long i, ops = 1000000, nblocks;
+	int fd, do_write = 0;
+	ssize_t ret;
+
+	if (argc > 1 && !strcmp(argv[argc - 1], "-w")) {
+		do_write = 1;
+		argc--;
+	}
+	if (argc < 2) {
+		xxprint("usage: %s <file> [ops] [-w]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2) {
+		ops = atol(argv[2]);
+	}
+
+	fd = open(argv[1], do_write ? O_RDWR : O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror("open failed.");
+		return 1;
+	}
+	nblocks = st.st_size / IO_SIZE;
+	if (nblocks < 1) {
+		xxprint("%s: file must be at least %d bytes\n", argv[1], IO_SIZE);
+		return 1;
+	}
+
+	/* warm the page cache */
+	for (i = 0; i < nblocks && i < ops; i++) {
+		if (pread(fd, buf, IO_SIZE, (off_t)i * IO_SIZE) < 0) {
+			perror("pread failed.");
+			return 1;
+		}
+	}
+
+	memset(buf, 'x', IO_SIZE);
+	start = now_ns();
+	for (i = 0; i < ops; i++) {
+		if (do_write) {
+			ret = pwrite(fd, buf, IO_SIZE, (off_t)(i % nblocks) * IO_SIZE);
+		} else {
+			ret = pread(fd, buf, IO_SIZE, (off_t)(i % nblocks) * IO_SIZE);
+		}
+		if (ret != IO_SIZE) {
+			perror("I/O failed.");
+			return 1;
+		}
+	}
+	total_ns = now_ns() - start;
+
+	xxprint("%s: %ld %s of %d bytes, avg %.0f ns/call\n", argv[1], ops,
+		do_write ? "pwrites" : "preads", IO_SIZE, (double)total_ns / ops);
+
+	close(fd);
+	return 0;
+}
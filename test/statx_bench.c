@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dbg_define.h"
+
+/*
+ * usage: statx_bench <file> [ops]
+ *
+ * Average cost of stat() and of statx() with a few masks and sync flags
+ * on one file.  Run it on a loopfs file and on the same lower file; with
+ * the getattr fast path the loopfs numbers should be close to the lower.
+ */
+
+struct statx_case {
+	const char *name;
+	int flags;
+	unsigned int mask;
+};
+
+static const struct statx_case cases[] = {
+	{ "statx BASIC_STATS",		0,			STATX_BASIC_STATS },
+	{ "statx TYPE|MODE",		0,			STATX_TYPE | STATX_MODE },
+	{ "statx TYPE|INO",		0,			STATX_TYPE | STATX_INO },
+	{ "statx DONT_SYNC",		AT_STATX_DONT_SYNC,	STATX_BASIC_STATS },
+	{ "statx FORCE_SYNC",		AT_STATX_FORCE_SYNC,	STATX_BASIC_STATS },
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	struct statx stx;
+	struct stat st;
+	unsigned long long start;
+	long i, ops = 1000000;
+	int c;
+
+	if (argc < 2) {
+		xxprint("usage: %s <file> [ops]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2) {
+		ops = atol(argv[2]);
+	}
+
+	start = now_ns();
+	for (i = 0; i < ops; i++) {
+		if (stat(argv[1], &st)) {
+			perror("stat failed.");
+			return 1;
+		}
+	}
+	xxprint("%s: %-20s avg %.0f ns/call\n", argv[1], "stat",
+		(double)(now_ns() - start) / ops);
+
+	for (c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++) {
+		start = now_ns();
+		for (i = 0; i < ops; i++) {
+			if (statx(AT_FDCWD, argv[1], cases[c].flags, cases[c].mask, &stx)) {
+				perror("statx failed.");
+				return 1;
+			}
+		}
+		xxprint("%s: %-20s avg %.0f ns/call\n", argv[1], cases[c].name,
+			(double)(now_ns() - start) / ops);
+	}
+
+	return 0;
+}
@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dbg_define.h"
+
+/*
+ * usage: sync_file_range_test <file> [MiB]
+ *
+ * Writes the file in 1 MiB chunks the way RocksDB and PostgreSQL smooth
+ * out writeback: after each chunk, sync_file_range(SYNC_FILE_RANGE_WRITE)
+ * starts writeback of that chunk and the chunk before it is waited on.
+ * Then prints how long the final fdatasync takes and the system wide
+ * Dirty+Writeback from /proc/meminfo.
+ *
+ * If sync_file_range reaches the pages, the final fdatasync has almost
+ * nothing left to write.  Compare a loopfs file with a file on the lower.
+ */
+
+#define	CHUNK	(1024 * 1024)
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long dirty_kb(void)
+{
+	char line[128];
+	long kb, total = 0;
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (!f) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "Dirty: %ld kB", &kb) == 1 ||
+				sscanf(line, "Writeback: %ld kB", &kb) == 1) {
+			total += kb;
+		}
+	}
+	fclose(f);
+	return total;
+}
+
+int main(int argc, char *argv[])
+{
+	char *buf;
+	long i, mb = 256;
+	unsigned long long start;
+	int fd;
+
+	if (argc < 2) {
+		xxprint("usage: %s <file> [MiB]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2) {
+		mb = atol(argv[2]);
+	}
+
+	fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	buf = malloc(CHUNK);
+	if (fd < 0 || !buf) {
+		perror("open failed.");
+		return 1;
+	}
+	memset(buf, 0xa5, CHUNK);
+
+	for (i = 0; i < mb; i++) {
+		if (write(fd, buf, CHUNK) != CHUNK) {
+			perror("write failed.");
+			return 1;
+		}
+		if (sync_file_range(fd, i * CHUNK, CHUNK, SYNC_FILE_RANGE_WRITE)) {
+			perror("sync_file_range failed.");
+			return 1;
+		}
+		if (i > 0 && sync_file_range(fd, (i - 1) * CHUNK, CHUNK,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+				SYNC_FILE_RANGE_WAIT_AFTER)) {
+			perror("sync_file_range failed.");
+			return 1;
+		}
+	}
+
+	xxprint("%s: %ld MiB written, dirty+writeback %ld kB\n", argv[1], mb, dirty_kb());
+
+	start = now_ns();
+	if (fdatasync(fd)) {
+		perror("fdatasync failed.");
+		return 1;
+	}
+	xxprint("%s: final fdatasync %llu us\n", argv[1], (now_ns() - start) / 1000);
+
+	free(buf);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <liburing.h>
+
+#include "dbg_define.h"
+
+/*
+ * usage: uring_bench [-d | -p] <file> [ops] [queue depth]
+ *
+ * Random 4 KiB io_uring reads.  Prints the average latency per request
+ * and the highest number of io-wq worker threads seen during the run.
+ * Run it once on a loopfs file and once on the same lower file.
+ *
+ * default: buffered reads from a file whose pages are already cached.
+ *          On a file system that honors IOCB_NOWAIT the reads complete
+ *          inline and no workers appear.
+ * -d:      O_DIRECT reads, completed by interrupt.
+ * -p:      O_DIRECT reads on an IORING_SETUP_IOPOLL ring.  The lower
+ *          block device needs poll queues (null_blk poll_queues=N, or
+ *          nvme poll_queues=N).  Use queue depth 1 to compare latency.
+ *
+ * build: gcc -O2 -o uring_bench uring_bench.c -luring
+ */
+
+#define	BS	4096
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* io-wq workers are "io_wqe_worker-*" kthreads (5.11) or "iou-wrk-*" threads */
+static int count_io_workers(void)
+{
+	DIR *proc;
+	struct dirent *de;
+	char path[64], comm[32];
+	int count = 0;
+	FILE *f;
+
+	proc = opendir("/proc");
+	if (!proc) {
+		return -1;
+	}
+
+	while ((de = readdir(proc))) {
+		if (de->d_name[0] < '0' || de->d_name[0] > '9') {
+			continue;
+		}
+		snprintf(path, sizeof(path), "/proc/%s/comm", de->d_name);
+		f = fopen(path, "r");
+		if (!f) {
+			continue;
+		}
+		if (fgets(comm, sizeof(comm), f) &&
+				(!strncmp(comm, "io_wqe_worker", 13) || !strncmp(comm, "iou-wrk", 7))) {
+			count++;
+		}
+		fclose(f);
+	}
+
+	closedir(proc);
+	return count;
+}
+
+int main(int argc, char *argv[])
+{
+	struct io_uring ring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct stat st;
+	char *bufs;
+	unsigned long long start, total_ns;
+	long ops = 100000, done = 0, submitted = 0, nblocks;
+	int depth = 32;
+	int fd, i, workers, max_workers = 0;
+	int direct = 0, iopoll = 0;
+	const char *mode = "buffered";
+
+	while (argc > 1 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-d")) {
+			direct = 1;
+			mode = "direct";
+		} else if (!strcmp(argv[1], "-p")) {
+			direct = iopoll = 1;
+			mode = "iopoll";
+		}
+		argv++;
+		argc--;
+	}
+
+	if (argc < 2) {
+		xxprint("usage: %s [-d | -p] <file> [ops] [queue depth]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2) {
+		ops = atol(argv[2]);
+	}
+	if (argc > 3) {
+		depth = atoi(argv[3]);
+	}
+
+	fd = open(argv[1], direct ? O_RDONLY | O_DIRECT : O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror("open failed.");
+		return 1;
+	}
+	nblocks = st.st_size / BS;
+	if (nblocks < 1) {
+		xxprint("%s: file must be at least %d bytes\n", argv[1], BS);
+		return 1;
+	}
+
+	if (posix_memalign((void **)&bufs, BS, (size_t)depth * BS)) {
+		return 1;
+	}
+
+	/* warm the page cache so that every buffered read is a cache hit */
+	for (i = 0; !direct && i < nblocks; i++) {
+		if (pread(fd, bufs, BS, (off_t)i * BS) < 0) {
+			perror("pread failed.");
+			return 1;
+		}
+	}
+
+	if (io_uring_queue_init(depth, &ring, iopoll ? IORING_SETUP_IOPOLL : 0)) {
+		perror("io_uring_queue_init failed.");
+		return 1;
+	}
+
+	srandom(1);
+	start = now_ns();
+	while (done < ops) {
+		while (submitted < ops && submitted - done < depth) {
+			sqe = io_uring_get_sqe(&ring);
+			if (!sqe) {
+				break;
+			}
+			io_uring_prep_read(sqe, fd, bufs + (submitted % depth) * BS, BS,
+					(off_t)(random() % nblocks) * BS);
+			submitted++;
+		}
+		io_uring_submit(&ring);
+
+		if (io_uring_wait_cqe(&ring, &cqe)) {
+			perror("io_uring_wait_cqe failed.");
+			return 1;
+		}
+		if (cqe->res < 0) {
+			xxprint("read failed: %s\n", strerror(-cqe->res));
+			return 1;
+		}
+		io_uring_cqe_seen(&ring, cqe);
+		done++;
+
+		if (!(done % 4096)) {
+			workers = count_io_workers();
+			if (workers > max_workers) {
+				max_workers = workers;
+			}
+		}
+	}
+	total_ns = now_ns() - start;
+
+	xxprint("%s: %s, %ld reads, qd %d, avg %.0f ns/read, max io-wq workers %d\n",
+		argv[1], mode, ops, depth, (double)total_ns / ops, max_workers);
+
+	io_uring_queue_exit(&ring);
+	free(bufs);
+	close(fd);
+	return 0;
+}